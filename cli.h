@@ -0,0 +1,123 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * What ng-bridge and ng-eiface share now that all the work is done by
+ * libngvjail: turning its error codes into messages and exit status.
+ */
+
+#ifndef _DMARKER_CLI_H
+#define _DMARKER_CLI_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <net/if.h>
+
+#include "ngvjail.h"
+
+#define STRFY2(x) #x
+#define STRFY(x) STRFY2(x)
+
+typedef void (*check_err)(const char *, const char *, const char *);
+
+static inline void
+open_ctx(struct ngvj_ctx *ctx, int flags)
+{
+	int	rc;
+
+	if (NGVJ_OK != (rc = ngvj_open(ctx, flags))) {
+		(void) fprintf(stderr,
+		    ME ": Error: Failed to initialize netgraph(8)\n%s\n\n",
+		    ngvj_strerror(ctx, rc)
+		);
+		exit(-1);
+	}
+}
+
+/* requires `int err` declared, and you should zero before checking */
+#define VALIDATE_NODE(ptr) \
+	if (NULL != ptr && NGVJ_OK != ngvj_valid_name(ptr)) { \
+		err = 1; \
+		(void) fprintf(stderr, \
+		    ME ": Error: invalid " #ptr \
+		    ", must be less than " STRFY(IFNAMSIZ) " characters " \
+		    "composed of a-zA-Z0-9 or '-'\n" \
+		); \
+	}
+
+
+static inline int
+ng_check(struct ngvj_ctx *ctx, const char *node, const char *expected,
+    check_err err)
+{
+	const char	*type;
+
+	if (NULL == node)
+		return (0);
+
+	type = ngvj_type(ctx, node);
+	if (NULL == type) {
+		(void) fprintf(stderr, ME ": %s\n", ngvj_strerror(ctx, NGVJ_ESYS));
+		return (1);
+	}
+	if (0 != strcmp(type, expected)) {
+		err(node, type, expected);
+		return (1);
+	}
+	return (0);
+}
+
+static void
+exist_err(const char *node, const char *type, const char *expected)
+{
+	if (0 == strcmp(type, "nonexistent")) {
+		(void) fprintf(stderr,
+		    ME ": Error: %s %s doesn't exist\n",
+		    node, expected 
+		);
+	} else {
+		(void) fprintf(stderr,
+		    ME ": Error: %s type %s expected %s\n",
+		    node, type, expected
+		);
+	}
+}
+
+
+static void
+nonexist_err(const char *node, const char *type, const char *unused)
+{
+	(void) fprintf(stderr,
+	    ME ": Error: %s %s already exists\n",
+	    node, type
+	);
+}
+
+
+#define NG_EXIST(ptr) ng_check(&ctx, ptr, STRFY(ptr), exist_err)
+#define NG_NOTEXIST(ptr) ng_check(&ctx, ptr, "nonexistent", nonexist_err)
+
+#endif /*  _DMARKER_CLI_H */
@@ -22,94 +22,124 @@
  * SOFTWARE.
  */
 
-#ifndef _DMARKER_CMD_H
-#define _DMARKER_CMD_H
+#ifndef _DMARKER_COMMON_H
+#define _DMARKER_COMMON_H
 
 #include <errno.h>
 #include <netgraph.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <net/bpf.h>
+#include <netgraph/ng_bpf.h>
 
-#define STRFY2(x) #x
-#define STRFY(x) STRFY2(x)
+#include "ngvjail.h"
 
-typedef void (*check_err)(const char *, const char *, const char *);
+/*
+ * Everything in here is for the library's own use. Inside, every node name
+ * has the ':' on the end so it is a netgraph path, and functions return -1
+ * with errno set like the system calls they are made of. The ngvj_* entry
+ * points turn that into an NGVJ_E* code on the way out.
+ */
 
+/*
+ * The public names don't have the ':', add it. Shard names can be longer
+ * than an interface name so this only keeps out what netgraph won't take.
+ */
 static inline int
-create_ng_sock(void)
+ngvj_path(char *dst, size_t len, const char *name)
 {
-	int	skt;
-	char    name[NG_NODESIZ];
+	if (NULL == name || '\0' == *name || strlen(name) >= NG_NODESIZ ||
+	    NULL != strpbrk(name, ".:[]"))
+		return (NGVJ_EINVAL);
+	(void) snprintf(dst, len, "%s:", name);
+	return (NGVJ_OK);
+}
 
-	snprintf(name, sizeof(name), "ngctl%d", getpid());
+/* every entry point starts with this, so old errors don't linger */
+static inline void
+ngvj_begin(struct ngvj_ctx *ctx, const char *step)
+{
+	ctx->sys_errno = 0;
+	ctx->step = step;
+}
 
-	if (-1 == NgMkSockNode(name, &skt, NULL)) {
-		int err = errno;
-		(void) fprintf(stderr,
-		    ME ": Error: Failed to initialize netgraph(8)\n%s\n\n",
-		    strerror(err)
-		);
-		exit(-1);
+/* on the way out of a failed entry point, errno is still what went wrong */
+static inline int
+ngvj_error(struct ngvj_ctx *ctx)
+{
+	ctx->sys_errno = errno;
+	switch (errno) {
+	case EINVAL:
+		return (NGVJ_EINVAL);
+	case ENOENT:
+		return (NGVJ_ENOENT);
+	case EEXIST:
+		return (NGVJ_EEXIST);
+	case EBUSY:
+		return (NGVJ_EBUSY);
+	case ETIMEDOUT:
+		return (NGVJ_ETIMEDOUT);
+	default:
+		return (NGVJ_ESYS);
 	}
-	return skt;
 }
 
+/*
+ * Replies can only be told apart by the token NgSendMsg() returned for the
+ * question. One we stopped waiting for (see ng_list_hooks()) may still turn
+ * up later, and would then be read as the answer to the next question, so
+ * everything that isn't for token is thrown away. Returns what
+ * NgAllocRecvMsg() does.
+ */
+#define	NG_REPLY_WAIT	1000	/* ms, replies are normally there already */
+
 static inline int
-validate_node(const char *node)
-{
-	if (NULL == node) return (0);
-	if (strlen(node) >= IFNAMSIZ) return (-1);
-	/* only allow a-zA-Z0-9 and '-' itself
-	 * A-z is (65,122]
-	 * 0-9 is (48,57]
-	 * - is 45
-	 * ':' is a netgraph separator, '[' and ']' indicate IDs in netgraph
-	 * and really this is going to be a system interface name so that's
-	 * allyou need.
-	 */
-	while('\0' != *node) {
-		if (45 == *node ||
-		    (*node >= 48 && *node <= 57) ||
-		    (*node >= 65 && *node <= 122)
-		) {
-			node++;
-			continue;
-		} else {
+ng_recv_reply(int ngs, int token, struct ng_mesg **resp)
+{
+	int		rc;
+	struct pollfd	pfd = {
+		.fd = ngs,
+		.events = POLLIN
+	};
+
+	for (;;) {
+		rc = poll(&pfd, 1, NG_REPLY_WAIT);
+		if (-1 == rc && EINTR == errno) continue;
+		if (-1 == rc) return (-1);
+		if (0 == rc) {
+			errno = ETIMEDOUT;
 			return (-1);
 		}
+		if (-1 == (rc = NgAllocRecvMsg(ngs, resp, NULL))) return (-1);
+		if ((int) (*resp)->header.token == token) return (rc);
+		free(*resp);
 	}
-	return (0);
-}
-
-/* requires `int err` declared, and you should zero before checking */
-#define VALIDATE_NODE(ptr) \
-	if (0 != validate_node(ptr)) { \
-		err = 1; \
-		(void) fprintf(stderr, \
-		    ME ": Error: invalid " #ptr \
-		    ", must be less than " STRFY(IFNAMSIZ) " characters " \
-		    "composed of a-zA-Z0-9 or '-'\n" \
-		); \
-	}
-
+}
 
-#define	COPY_NAME(src, dst) \
-	if (NULL != src) { \
-		(void) strlcpy(dst, src, sizeof(dst)); \
-		(void) strlcat(dst, ":", sizeof(dst)); \
-		src = dst; \
-	}
+/* a question that gets an answer, NGM_NODEINFO and the like */
+static inline int
+ng_ask(int ngs, const char *path, int cookie, int cmd, const void *arg,
+    size_t arglen, struct ng_mesg **resp)
+{
+	int	token;
 
+	if (-1 == (token = NgSendMsg(ngs, path, cookie, cmd, arg, arglen)))
+		return (-1);
+	return (ng_recv_reply(ngs, token, resp));
+}
 
 /* ng_type() returns a char * into Type or NULL
  * These match the names netgraph reports so that we can just do
  * strcmp and return the matching one, when a node is found.
  */
-
-/* helper for ng_check */
 static inline const char * const
 ng_type(int ngs, const char *node)
 {
@@ -120,12 +150,13 @@ ng_type(int ngs, const char *node)
 		"bridge",
 		"eiface",
 		"ether",
+		"tee",
 		"unknown",
 		"nonexistent"
 	};
-#	define NTYPE 3
-#	define UNKNOWN Type[3]
-#	define NONEXISTENT Type[4]
+#	define NTYPE 4
+#	define UNKNOWN Type[4]
+#	define NONEXISTENT Type[5]
 
 	rc = NgSendMsg(ngs, node, NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0);
 	if (-1 == rc) {
@@ -134,7 +165,7 @@ ng_type(int ngs, const char *node)
 		else
 			return (NULL); /* error */
 	}
-	if (-1 == NgAllocRecvMsg(ngs, &resp, NULL)) return (NULL);
+	if (-1 == ng_recv_reply(ngs, rc, &resp)) return (NULL);
 	ninfo = (struct nodeinfo *) resp->data;
 
 	for (ix = 0; ix < NTYPE; ix++) {
@@ -145,56 +176,291 @@ ng_type(int ngs, const char *node)
 }
 
 
+/*
+ * A sharded bridge is several ng_bridge nodes that look like one. Shard 0 has
+ * the name the user gave and is the only one anybody outside these utilities
+ * needs to know about. Shard k > 0 is named "<bridge>-s<k>" and is joined to
+ * shard 0 by a trunk link, so the shards form a star with no loops.
+ */
+
+/* like everything else, bridge has the ':' on the end and so will dst */
+static inline void
+shard_path(char *dst, size_t len, const char *bridge, int shard)
+{
+	if (0 == shard) {
+		(void) strlcpy(dst, bridge, len);
+		return;
+	}
+	(void) snprintf(dst, len, "%.*s-s%d:",
+	    (int)(strlen(bridge) - 1), bridge, shard
+	);
+}
+
+/* number of hooks on a node, or -1 */
+static inline int
+ng_hooks(int ngs, const char *node)
+{
+	int		hooks;
+	struct ng_mesg	*resp;
+	struct nodeinfo *ninfo;
+
+	if (-1 == ng_ask(ngs, node, NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0,
+	    &resp))
+		return (-1);
+	ninfo = (struct nodeinfo *) resp->data;
+	hooks = ninfo->hooks;
+	free(resp);
+	return (hooks);
+}
+
+/*
+ * NGM_LISTHOOKS replies are only as big as the hooks on the node, but for a
+ * bridge with thousands of links that is megabytes. The reply can't be
+ * received unless it fits in our socket's receive buffer, and if it doesn't
+ * the kernel drops it and there is nothing to read at all. So find out how
+ * many hooks there are first and size the buffer for them, with some slack
+ * for links added in between. If the reply still doesn't show up, the buffer
+ * is doubled and we ask again. Should the first reply turn up after all, it
+ * has the old token and ng_recv_reply() drops it.
+ */
+#define	NG_HOOK_SLACK	64
+#define	NG_LIST_TRIES	4
+
 static inline int
-ng_check(int ngskt, const char *node, const char *expected, check_err err)
+ng_list_hooks(int ngs, const char *node, struct ng_mesg **resp)
 {
-	int		rc;
-	const char	*type;
+	int		hooks, tries, size, cur, token, rc;
+	socklen_t	len;
+
+	if (-1 == (hooks = ng_hooks(ngs, node))) return (-1);
+	size = sizeof(struct ng_mesg) + sizeof(struct hooklist) +
+	    (hooks + NG_HOOK_SLACK) * sizeof(struct linkinfo);
+
+	for (tries = 0; tries < NG_LIST_TRIES; tries++, size *= 2) {
+		len = sizeof(cur);
+		if (-1 == getsockopt(ngs, SOL_SOCKET, SO_RCVBUF, &cur, &len))
+			return (-1);
+		/* ENOBUFS here means kern.ipc.maxsockbuf is too small */
+		if (cur < size && -1 == setsockopt(ngs, SOL_SOCKET, SO_RCVBUF,
+		    &size, sizeof(size)))
+			return (-1);
 
-	if (NULL == node)
-		return (0);
+		if (-1 == (token = NgSendMsg(ngs, node, NGM_GENERIC_COOKIE,
+		    NGM_LISTHOOKS, NULL, 0)))
+			return (-1);
+		rc = ng_recv_reply(ngs, token, resp);
+		if (-1 != rc || ETIMEDOUT != errno)
+			return (rc);
+	}
+	errno = ENOBUFS;
+	return (-1);
+}
 
-	type = ng_type(ngskt, node);
-	if (NULL == type) {
-		(void) perror(ME);
-		return (1);
+/*
+ * A plain bridge is just a sharded bridge with a single shard. Going by the
+ * names alone would take somebody else's bridge that happens to be called
+ * "<bridge>-s1" for one of ours, so a shard only counts if it is trunked to
+ * shard 0, and they are numbered without gaps.
+ */
+static inline int
+shard_count(int ngs, const char *bridge)
+{
+	int		idx, shard;
+	u_int		found;
+	size_t		len;
+	char		path[NG_PATHSIZ];
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+
+	if (-1 == ng_list_hooks(ngs, bridge, &resp)) return (1);
+	hlist = (struct hooklist *) resp->data;
+	found = 0;
+	for (idx = 0; idx < hlist->nodeinfo.hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+
+		if (0 != strcmp(link->nodeinfo.type, "bridge")) continue;
+		for (shard = 1; shard < NGVJ_SHARD_MAX; shard++) {
+			shard_path(path, sizeof(path), bridge, shard);
+			len = strlen(path) - 1; /* no ':' on the peer's name */
+			if (len == strlen(link->nodeinfo.name) &&
+			    0 == strncmp(link->nodeinfo.name, path, len))
+				found |= 1 << shard;
+		}
 	}
-	rc = strcmp(type, expected);
-	if (0 != rc) {
-		err(node, type, expected);
-		return (1);
+	free(resp);
+
+	for (shard = 1; shard < NGVJ_SHARD_MAX; shard++)
+		if (0 == (found & (1 << shard))) break;
+	return (shard);
+}
+
+/*
+ * Eifaces on one shard, or -1. They are on the "link" hooks, behind a tap
+ * or the proxy's bpf if there is one. Trunks, the ether and tunnels (on
+ * uplinks) don't count.
+ */
+static inline int
+shard_eifaces(int ngs, const char *path)
+{
+	int		idx, count;
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+
+	if (-1 == ng_list_hooks(ngs, path, &resp)) return (-1);
+	hlist = (struct hooklist *) resp->data;
+	count = 0;
+	for (idx = 0; idx < hlist->nodeinfo.hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+		const char *type = link->nodeinfo.type;
+
+		if (0 != strncmp(link->ourhook, "link", 4)) continue;
+		if (0 == strcmp(type, "eiface") || 0 == strcmp(type, "bpf") ||
+		    0 == strcmp(type, "tee"))
+			count++;
 	}
-	return (0);
-}
-
-static void
-exist_err(const char *node, const char *type, const char *expected)
-{
-	if (0 == strcmp(type, "nonexistent")) {
-		(void) fprintf(stderr,
-		    ME ": Error: %s %s doesn't exist\n",
-		    node, expected 
-		);
-	} else {
-		(void) fprintf(stderr,
-		    ME ": Error: %s type %s expected %s\n",
-		    node, type, expected
-		);
+	free(resp);
+	return (count);
+}
+
+/* pick the shard with the fewest eifaces for a new one */
+static inline int
+least_loaded_shard(int ngs, const char *bridge, char *dst, size_t len)
+{
+	int	shards, shard, eifaces, best, least;
+	char	path[NG_PATHSIZ];
+
+	shards = shard_count(ngs, bridge);
+	best = 0;
+	least = -1;
+	for (shard = 0; shard < shards; shard++) {
+		shard_path(path, sizeof(path), bridge, shard);
+		if (-1 == (eifaces = shard_eifaces(ngs, path))) continue;
+		if (-1 == least || eifaces < least) {
+			least = eifaces;
+			best = shard;
+		}
 	}
+	if (-1 == least) return (-1);
+	shard_path(dst, len, bridge, best);
+	return (best);
+}
+
+/* the program for one hook of an ng_bpf, which has to be connected already */
+static inline int
+set_bpf_prog(int ngs, const char *bpf, const char *hook, const char *match,
+    const char *nomatch, const struct bpf_insn *insns, int len)
+{
+	int			rc;
+	struct ng_bpf_hookprog	*hp;
+
+	if (NULL == (hp = calloc(1, NG_BPF_HOOKPROG_SIZE(len))))
+		return (-1);
+	(void) strlcpy(hp->thisHook, hook, sizeof(hp->thisHook));
+	(void) strlcpy(hp->ifMatch, match, sizeof(hp->ifMatch));
+	(void) strlcpy(hp->ifNotMatch, nomatch, sizeof(hp->ifNotMatch));
+	hp->bpf_prog_len = len;
+	bcopy(insns, hp->bpf_prog, len * sizeof(*insns));
+
+	rc = NgSendMsg(ngs, bpf, NGM_BPF_COOKIE, NGM_BPF_SET_PROGRAM,
+	    hp, NG_BPF_HOOKPROG_SIZE(len));
+	free(hp);
+	return ((-1 == rc) ? -1 : 0);
 }
 
+/*
+ * Where things are in an untagged ARP or neighbor discovery frame, for the
+ * proxy and for announcing a new eiface. Everything is built byte by byte so
+ * nothing depends on how the kernel headers pack their structs.
+ */
+#define	OFF_TYPE	12
+#define	OFF_ARP_OP	20
+#define	OFF_ARP_SHA	22
+#define	OFF_ARP_SPA	28
+#define	OFF_ARP_THA	32
+#define	OFF_ARP_TPA	38
+#define	ARP_LEN		42
+#define	OFF_IP6_PLEN	18
+#define	OFF_IP6_NXT	20
+#define	OFF_IP6_HLIM	21
+#define	OFF_IP6_SRC	22
+#define	OFF_IP6_DST	38
+#define	OFF_ICMP6	54
+#define	OFF_ND_TARGET	62
+#define	OFF_ND_OPT	78
+#define	NA_LEN		86
+#define	FRAME_MIN	60
 
-static void
-nonexist_err(const char *node, const char *type, const char *unused)
+/* an ARP packet padded out to the smallest frame, returns the length */
+static inline int
+arp_frame(u_char *f, int op, const u_char *dst, const u_char *sha,
+    const u_char *spa, const u_char *tha, const u_char *tpa)
 {
-	(void) fprintf(stderr,
-	    ME ": Error: %s %s already exists\n",
-	    node, type
-	);
+	bzero(f, FRAME_MIN);
+	bcopy(dst, f, ETHER_ADDR_LEN);
+	bcopy(sha, f + ETHER_ADDR_LEN, ETHER_ADDR_LEN);
+	f[OFF_TYPE] = ETHERTYPE_ARP >> 8;
+	f[OFF_TYPE + 1] = ETHERTYPE_ARP & 0xff;
+	f[15] = 1;				/* ethernet */
+	f[16] = 0x08;				/* IPv4 */
+	f[18] = ETHER_ADDR_LEN;
+	f[19] = 4;
+	f[OFF_ARP_OP + 1] = op;
+	bcopy(sha, f + OFF_ARP_SHA, ETHER_ADDR_LEN);
+	bcopy(spa, f + OFF_ARP_SPA, 4);
+	bcopy(tha, f + OFF_ARP_THA, ETHER_ADDR_LEN);
+	bcopy(tpa, f + OFF_ARP_TPA, 4);
+	return (FRAME_MIN);
 }
 
+static inline u_short
+icmp6_cksum(const u_char *f, int len)
+{
+	int		idx;
+	uint32_t	sum = 0;
+
+	/* pseudo header: addresses, upper layer length and next header */
+	for (idx = OFF_IP6_SRC; idx < OFF_ICMP6; idx += 2)
+		sum += (f[idx] << 8) | f[idx + 1];
+	sum += len;
+	sum += IPPROTO_ICMPV6;
+	for (idx = OFF_ICMP6; idx < OFF_ICMP6 + len; idx += 2)
+		sum += (f[idx] << 8) | f[idx + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (~sum & 0xffff);
+}
 
-#define NG_EXIST(ptr) ng_check(ngskt, ptr, STRFY(ptr), exist_err)
-#define NG_NOTEXIST(ptr) ng_check(ngskt, ptr, "nonexistent", nonexist_err)
+/*
+ * A neighbor advertisement from addr at mac, with its target link-layer
+ * option. flags are the ND_NA_FLAG_* ones, returns the length.
+ */
+static inline int
+na_frame(u_char *f, const u_char *dst, const u_char *mac, const u_char *addr,
+    const u_char *to, uint32_t flags)
+{
+	u_short	sum;
+
+	bzero(f, NA_LEN);
+	bcopy(dst, f, ETHER_ADDR_LEN);
+	bcopy(mac, f + ETHER_ADDR_LEN, ETHER_ADDR_LEN);
+	f[OFF_TYPE] = ETHERTYPE_IPV6 >> 8;
+	f[OFF_TYPE + 1] = ETHERTYPE_IPV6 & 0xff;
+	f[14] = 0x60;				/* version */
+	f[OFF_IP6_PLEN + 1] = NA_LEN - OFF_ICMP6;
+	f[OFF_IP6_NXT] = IPPROTO_ICMPV6;
+	f[OFF_IP6_HLIM] = 255;
+	bcopy(addr, f + OFF_IP6_SRC, 16);
+	bcopy(to, f + OFF_IP6_DST, 16);
+	f[OFF_ICMP6] = ND_NEIGHBOR_ADVERT;
+	bcopy(&flags, f + OFF_ICMP6 + 4, sizeof(flags)); /* already big endian */
+	bcopy(addr, f + OFF_ND_TARGET, 16);
+	f[OFF_ND_OPT] = ND_OPT_TARGET_LINKADDR;
+	f[OFF_ND_OPT + 1] = 1;			/* 8 bytes */
+	bcopy(mac, f + OFF_ND_OPT + 2, ETHER_ADDR_LEN);
+	sum = icmp6_cksum(f, NA_LEN - OFF_ICMP6);
+	f[OFF_ICMP6 + 2] = sum >> 8;
+	f[OFF_ICMP6 + 3] = sum & 0xff;
+	return (NA_LEN);
+}
 
-#endif /*  _DMARKER_CMD_H */
+#endif /*  _DMARKER_COMMON_H */
@@ -21,185 +21,142 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
-#include "common.h"
+#include "cli.h"
 
 #include <errno.h>
-#include <net/ethernet.h>
-#include <netgraph/ng_bridge.h>
-#include <netgraph/ng_ether.h>
-
-static int
-ether_is_connected(int ngs, char *ether)
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pcap.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+static struct addrinfo *
+tunnel_addr(const char *addr, const char *port)
 {
-	int		rc, idx;
-	struct ng_mesg	*resp;
-	struct hooklist *hlist;
-	struct nodeinfo	*ninfo;
-
-	rc = NgSendMsg(ngs, ether, NGM_GENERIC_COOKIE, NGM_LISTHOOKS, NULL, 0);
-	if (-1 == rc) return (-1);
-	if (-1 == NgAllocRecvMsg(ngs, &resp, NULL)) return (-1);
-	
-	hlist = (struct hooklist *) resp->data;
-	ninfo = &hlist->nodeinfo;
-
-	rc = 0;
-	for (idx = 0; idx < ninfo->hooks; idx++) {
-		struct linkinfo *const link = &hlist->link[idx];
-		if ('\0' != *link->peerhook) rc++;
-	}
-	free(resp);
-	return (rc);
-}
-
-
-/*
- * Connecting an ethernet interface means connecting the lower and upper hooks
- * to the bridge. This does mean it takes up 2 hooks, not just one.
- *
- * This is only called on newly created bridges. This means link0 and link1
- * are free and should be used on the bridge.
- */
-int
-connect_ether(int ngs, char *bridge, char *ether)
-{
-	int			rc;
-	static const int	mode = 1;
-	struct ngm_connect	cn[] = {
-		{
-#	define UP	0
-			.ourhook = "upper",
-			.peerhook = "link0"
-		},{
-#	define LO	1
-			.ourhook = "lower",
-			.peerhook = "uplink1" /* new feature */
-		}
+	struct addrinfo	*ai;
+	struct addrinfo	hints = {
+		.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+		.ai_protocol = IPPROTO_UDP
 	};
+	int		rc;
 
-	strlcpy(cn[LO].path, bridge, sizeof(cn[LO].path));
-	strlcpy(cn[UP].path, bridge, sizeof(cn[UP].path));
-
-	/* we need to have the iface in promisc mode */
-	rc = NgSendMsg(ngs, ether, NGM_ETHER_COOKIE,
-		    NGM_ETHER_SET_PROMISC, &mode, sizeof(mode));
-	if (-1 == rc) return (-1); /* must be able to put in this mode */
-
-	/* return positive int ... */
-	(void) NgSendMsg(ngs, ether, NGM_GENERIC_COOKIE,
-	    NGM_CONNECT, &cn[UP], sizeof(cn[UP]));
-	(void) NgSendMsg(ngs, ether, NGM_GENERIC_COOKIE,
-	    NGM_CONNECT, &cn[LO], sizeof(cn[LO]));
-	return (0);
+	if (0 != (rc = getaddrinfo(addr, port, &hints, &ai))) {
+		(void) fprintf(stderr,
+		    ME ": Error: %s port %s: %s\n", addr, port, gai_strerror(rc)
+		);
+		return (NULL);
+	}
+	return (ai);
 }
 
 
-/* netgraph doesn't distinguish between logical and physical */
-int
-create_bridge(int ngs, char *bridge)
-{
-	struct ngm_name nm;
-	struct ngm_rmhook rm = {
-		.ourhook = "link0"
-	};
-	struct ngm_mkpeer mp = {
-		.type = "bridge",
-		.ourhook = "lower",
-		.peerhook = "link0" /* always starts at 0 -- but nothing connected yet */
-	};
+#define	TAP_SNAPLEN	65535
+#define	TAP_LIMIT	16	/* megabytes */
 
-	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
-		return (-1);
+/* -t and -a run until told to stop */
+static volatile sig_atomic_t running = 1;
 
-	/*
-	 * Unfortunately this is one time we don't want ':' on the end of the name.
-	 * But for sake of consistent args to functions we will remove it rather than
-	 * pass in a different string here.
-	 */
-	(void) strlcpy(nm.name, bridge, sizeof(nm.name));
-	*(nm.name + strlen(nm.name) - 1) = '\0'; /* remove ':' */
-	if (-1 == NgSendMsg(ngs, ".:lower", NGM_GENERIC_COOKIE, NGM_NAME, &nm, sizeof(nm)))
-		return (-1);
-
-	/* need to set NGM_BRIDGE_SET_PERSISTENT so it stays! */
-	if (-1 == NgSendMsg(ngs, bridge, NGM_BRIDGE_COOKIE, NGM_BRIDGE_SET_PERSISTENT, NULL, 0))
-		return (-1);
-
-	/* this socket is connected to link0, disconnect from it */
-	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm)))
-		return (-1);
-
-	return (0);
+static void
+stop(int sig)
+{
+	running = 0;
 }
 
-
 /*
- * Any connected nodes are removed. For eiface this would be like having the
- * cat5 pulled out. They will still need `ng-eiface -d` to destroy them.
+ * The ring is two pcap files: <file> being written and <file>.1 holding the
+ * one before it. Each gets half of limit so together they never pass it.
+ * Errors are printed here, only pcap's own have anything in pcap_geterr().
  */
-int
-destroy_bridge(int ngs, char *bridge)
+static int
+tap_capture(struct ngvj_ctx *ctx, pcap_t *pcap, const char *file, long limit)
 {
-	int		rc, idx;
-	struct ng_mesg	*resp;
-	struct hooklist *hlist;
-	struct nodeinfo *ninfo;
-	
-	rc = NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_LISTHOOKS, NULL, 0);
-	if (-1 == rc) return (-1);
-	if (-1 == NgAllocRecvMsg(ngs, &resp, NULL)) return (-1);
-	
-	hlist = (struct hooklist *) resp->data;
-	ninfo = &hlist->nodeinfo;
-
-#if	0
-	/* this was checked in ng-bridge.c already ... */
-	if (0 != strcmp(ninfo->type, "bridge")) {
-		free(resp);
+	int			rc, len;
+	pcap_dumper_t		*dump;
+	struct pcap_pkthdr	hdr;
+	struct pollfd		pfd = {
+		.fd = ctx->dsock,
+		.events = POLLIN
+	};
+	static u_char		frame[TAP_SNAPLEN];
+	char			prev[PATH_MAX];
+
+	(void) snprintf(prev, sizeof(prev), "%s.1", file);
+	if (NULL == (dump = pcap_dump_open(pcap, file))) {
+		(void) fprintf(stderr,
+		    ME ": Error: capture: %s: %s\n", file, pcap_geterr(pcap)
+		);
 		return (-1);
 	}
-#	endif
-
-
-	/* all interfaces can be removed, if link0 is ether then set promisc off */
-	for (idx = 0; idx < ninfo->hooks; idx++) {
-		struct linkinfo *const link = &hlist->link[idx];
-		char *type = link->nodeinfo.type;
-		/*
-		 * going to cheat, we can cast link to be an ngm_rmhook
-		 * because all an ngm_rmhook has is the ourhook char array
-		 * and that is the first thing in a linkinfo
-		 */
-		rc = NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE,
-		    NGM_RMHOOK, link, sizeof(struct ngm_rmhook));
-
-		if ((0 == strcmp(type, "ether")) &&
-		    (0 == strcmp(link->ourhook, "link0"))) {
-			int prom = 0;
-			char *name = link->nodeinfo.name;
-			char path[NG_PATHSIZ];
-
-			(void) strlcpy(path, name, sizeof(path));
-			(void) strlcat(path, ":", sizeof(path));
-			/* remove promisc mode */
-
-			rc = NgSendMsg(ngs, path, NGM_ETHER_COOKIE,
-				    NGM_ETHER_SET_PROMISC, &prom, sizeof(prom));
+
+	while (running) {
+		rc = poll(&pfd, 1, 1000);
+		if (-1 == rc && EINTR != errno) {
+			(void) fprintf(stderr,
+			    ME ": Error: capture: poll: %s\n", strerror(errno)
+			);
+			break;
+		}
+		if (0 == rc) {
+			/* quiet, good time to let tail -f see it */
+			(void) pcap_dump_flush(dump);
+		}
+		if (1 != rc) continue;
+
+		if (-1 == (len = ngvj_tap_recv(ctx, frame, sizeof(frame)))) {
+			if (EINTR == errno) continue;
+			(void) fprintf(stderr,
+			    ME ": Error: capture: recv: %s\n", strerror(errno)
+			);
+			break;
+		}
+		(void) gettimeofday(&hdr.ts, NULL);
+		hdr.caplen = hdr.len = len;
+		pcap_dump((u_char *) dump, &hdr, frame);
+
+		if (pcap_dump_ftell(dump) >= limit / 2) {
+			pcap_dump_close(dump);
+			(void) rename(file, prev);
+			if (NULL == (dump = pcap_dump_open(pcap, file))) {
+				(void) fprintf(stderr,
+				    ME ": Error: capture: %s: %s\n",
+				    file, pcap_geterr(pcap)
+				);
+				return (-1);
+			}
 		}
 	}
-	free(resp);
+	pcap_dump_close(dump);
+	return (running ? -1 : 0);
+}
 
-	/* send shutdown for our bridge, since we set persist */
-	rc = NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
 
+/* -l prints each link as "shard hook peer type" */
+static int
+print_link(const struct ngvj_link *link, void *unused)
+{
+	(void) fprintf(stdout, "%s %s %s %s\n",
+	    link->shard, link->hook, link->peer, link->type
+	);
 	return (0);
 }
 
 
 #define USAGE { \
 	(void) fprintf(stderr, \
-		"usage: " ME " -c <bridge> [ether]\n" \
+		"usage: " ME " -c <bridge> [ether] [-s shards] [-b pps]\n" \
 		"       " ME " -d <bridge>\n" \
+		"       " ME " -l <bridge>\n" \
+		"       " ME " -t <bridge> <hook> <file> [-f filter] [-m megabytes]\n" \
+		"       " ME " -u <bridge> <hook>\n" \
+		"       " ME " -k <bridge> <local addr> <local port> <peer addr> <peer port>\n" \
+		"       " ME " -b <bridge> [pps]\n" \
+		"       " ME " -a <bridge>\n" \
 	); \
 	exit(-1); \
 }
@@ -207,33 +164,85 @@ destroy_bridge(int ngs, char *bridge)
 int
 main(int argc, char **argv)
 {
-	int	rc, err, ngskt, cflag, dflag;
+	int	rc, err, cflag, dflag, tflag, uflag, kflag, lflag, bflag, aflag;
+	int	shards, idx;
+	long	pps;
+	struct ngvj_ctx ctx;
+	long	limit;
 	char	*bridge = NULL;
 	char	*ether = NULL;
-	char	ngpath[2][NG_PATHSIZ];
+	char	*hook = NULL;
+	char	*file = NULL;
+	char	*filter = NULL;
+	char	*end;
+	char	uplink[NGVJ_NAMESIZ];
+	struct addrinfo	*local = NULL;
+	struct addrinfo	*peer = NULL;
 
 	err = 0;
-	ngskt = -1;
 	cflag = 0;
 	dflag = 0;
+	tflag = 0;
+	uflag = 0;
+	kflag = 0;
+	lflag = 0;
+	bflag = 0;
+	aflag = 0;
+	shards = 1;
+	pps = -1;
+	limit = TAP_LIMIT;
 
 	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
 	/* valid args
 	 *	ng-bridge -c bridge
 	 *	ng-bridge -c bridge ether
+	 *	ng-bridge -c bridge [ether] -s shards
+	 *	ng-bridge -c bridge ether [-s shards] -b pps
          *      ng-bridge -d bridge
+	 *	ng-bridge -l bridge
+	 *	ng-bridge -t bridge hook file [-f filter] [-m megabytes]
+	 *	ng-bridge -u bridge hook
+	 *	ng-bridge -k bridge laddr lport paddr pport
+	 *	ng-bridge -b bridge [pps]
+	 *	ng-bridge -a bridge
 	 */
 	if (argc < 3) USAGE;
 
 	if (0 == strcmp(argv[1], "-c")) {
-		switch (argc) {
-		case 4:
-			ether = argv[3]; /* FALLTHROUGH */
-		case 3:
-			bridge = argv[2];
-			break;
-		default:
+		bridge = argv[2];
+		for (idx = 3; idx < argc; idx++) {
+			if (0 == strcmp(argv[idx], "-s")) {
+				if (++idx == argc) USAGE;
+				shards = (int) strtol(argv[idx], &end, 10);
+				if ('\0' != *end || shards < 1 ||
+				    shards > NGVJ_SHARD_MAX) {
+					(void) fprintf(stderr,
+					    ME ": Error: shards must be 1 to "
+					    STRFY(NGVJ_SHARD_MAX) "\n\n"
+					);
+					USAGE;
+				}
+			} else if (0 == strcmp(argv[idx], "-b")) {
+				if (++idx == argc) USAGE;
+				pps = strtol(argv[idx], &end, 10);
+				if ('\0' != *end || pps < 1 || pps > NGVJ_STORM_MAX) {
+					(void) fprintf(stderr,
+					    ME ": Error: pps must be 1 to "
+					    STRFY(NGVJ_STORM_MAX) "\n\n"
+					);
+					USAGE;
+				}
+			} else if (NULL == ether) {
+				ether = argv[idx];
+			} else {
+				USAGE;
+			}
+		}
+		if (-1 != pps && NULL == ether) {
+			(void) fprintf(stderr,
+			    ME ": Error: -b is only for a bridge with an ether\n\n"
+			);
 			USAGE;
 		}
 		cflag = 1;
@@ -244,9 +253,73 @@ main(int argc, char **argv)
 		bridge = argv[2];
 		dflag = 1;
 	}
-	if (0 == (cflag | dflag)) {
+	if (0 == strcmp(argv[1], "-l")) {
+		if (3 != argc) USAGE;
+		bridge = argv[2];
+		lflag = 1;
+	}
+	if (0 == strcmp(argv[1], "-t")) {
+		if (argc < 5) USAGE;
+		bridge = argv[2];
+		hook = argv[3];
+		file = argv[4];
+		for (idx = 5; idx < argc; idx++) {
+			if (0 == strcmp(argv[idx], "-f") && idx + 1 < argc) {
+				filter = argv[++idx];
+			} else if (0 == strcmp(argv[idx], "-m") && idx + 1 < argc) {
+				limit = strtol(argv[++idx], &end, 10);
+				if ('\0' != *end || limit < 1) USAGE;
+			} else {
+				USAGE;
+			}
+		}
+		tflag = 1;
+	}
+	if (0 == strcmp(argv[1], "-u")) {
+		if (4 != argc) USAGE;
+		bridge = argv[2];
+		hook = argv[3];
+		uflag = 1;
+	}
+	if (0 == strcmp(argv[1], "-k")) {
+		if (7 != argc) USAGE;
+		bridge = argv[2];
+		local = tunnel_addr(argv[3], argv[4]);
+		peer = tunnel_addr(argv[5], argv[6]);
+		if (NULL == local || NULL == peer) USAGE;
+		if (local->ai_family != peer->ai_family) {
+			(void) fprintf(stderr,
+			    ME ": Error: %s and %s must both be IPv4 or IPv6\n\n",
+			    argv[3], argv[5]
+			);
+			USAGE;
+		}
+		kflag = 1;
+	}
+	if (0 == strcmp(argv[1], "-b")) {
+		if (3 != argc && 4 != argc) USAGE;
+		bridge = argv[2];
+		if (4 == argc) {
+			pps = strtol(argv[3], &end, 10);
+			if ('\0' != *end || pps < 0 || pps > NGVJ_STORM_MAX) {
+				(void) fprintf(stderr,
+				    ME ": Error: pps must be 0 to "
+				    STRFY(NGVJ_STORM_MAX) "\n\n"
+				);
+				USAGE;
+			}
+		}
+		bflag = 1;
+	}
+	if (0 == strcmp(argv[1], "-a")) {
+		if (3 != argc) USAGE;
+		bridge = argv[2];
+		aflag = 1;
+	}
+	if (0 == (cflag | dflag | lflag | tflag | uflag | kflag | bflag | aflag)) {
 		(void) fprintf(stderr,
-		    ME ": Error: \"%s\" must be \"-c\" or \"-d\"\n\n", argv[1]
+		    ME ": Error: \"%s\" must be \"-c\", \"-d\", \"-l\", \"-t\", \"-u\", \"-k\", \"-b\" or \"-a\"\n\n",
+		    argv[1]
 		);
 		USAGE;
 	}
@@ -255,20 +328,14 @@ main(int argc, char **argv)
 	err = 0;
 	VALIDATE_NODE(bridge);
 	VALIDATE_NODE(ether);
+	VALIDATE_NODE(hook);
 	if (err) {
 		(void) fprintf(stderr, "\n");
 		USAGE;
 	}
 
-	/*
-	 * put the ':' on the end of bridge and ether so it doesn't have to be
-	 * done in every function after this.
-	 */
-	COPY_NAME(bridge, ngpath[0]);
-	COPY_NAME(ether, ngpath[1]);
-
-
-	ngskt = create_ng_sock();
+	/* a tap receives the copies on the data socket, the proxy requests */
+	open_ctx(&ctx, (tflag | aflag) ? NGVJ_DATA : 0);
 
 	/*
 	 * These checks are racy, interface names come and go along with
@@ -282,19 +349,32 @@ main(int argc, char **argv)
 	if (cflag) {
 		err += NG_NOTEXIST(bridge);
 		err += NG_EXIST(ether);
+		for (idx = 1; idx < shards; idx++) {
+			char	shard[NGVJ_NAMESIZ];
+
+			(void) ngvj_shard_name(shard, sizeof(shard), bridge, idx);
+			err += ng_check(&ctx, shard, "nonexistent", nonexist_err);
+		}
 		if (err) exit(-1);
 
 		/* verify ether isn't attached to a bridge already! */
-		if (NULL != ether && ether_is_connected(ngskt, ether)) {
-			(void) fprintf(stderr,
-			    ME ": Error: %s already connected to bridge\n",
-			    ether
-			);
+		if (NULL != ether && NGVJ_OK != (rc = ngvj_ether_busy(&ctx, ether))) {
+			if (NGVJ_EBUSY == rc)
+				(void) fprintf(stderr,
+				    ME ": Error: %s already connected to bridge\n",
+				    ether
+				);
+			else
+				(void) fprintf(stderr,
+				    ME ": Error: %s ether: %s\n",
+				    ether, ngvj_strerror(&ctx, rc)
+				);
 			exit(-1);
 		}
-		if (0 != (rc = create_bridge(ngskt, bridge))) {
+		if (NGVJ_OK != (rc = ngvj_bridge_create(&ctx, bridge))) {
 			(void) fprintf(stderr,
-			    ME ": Error: failed to create: %s bridge: %d\n", bridge, errno
+			    ME ": Error: failed to create: %s bridge: %s\n",
+			    bridge, ngvj_strerror(&ctx, rc)
 			);
 			exit(-1);
 		} else {
@@ -303,17 +383,46 @@ main(int argc, char **argv)
 				ME ": Success: create: %s bridge\n", bridge
 			);
 		}
-		if (NULL == ether) return (0); /* done */
-		if (0 != (rc = connect_ether(ngskt, bridge, ether))) {
+		/* ether first so it gets link0 and uplink1 ahead of any trunks */
+		if (NULL != ether) {
+			if (NGVJ_OK != (rc = ngvj_bridge_attach(&ctx, bridge, ether))) {
+				(void) fprintf(stderr,
+				    ME ": Error: failed to attatch: %s bridge <-> %s ether\n",
+				    bridge, ether
+				);
+				exit(-1);
+			} else {
+				(void) fprintf(stdout,
+				    ME ": Success: attach: bridge %s <-> %s ether\n",
+				    bridge, ether
+				);
+			}
+		}
+		/* before the trunks, a storm would go out over those too */
+		if (-1 != pps) {
+			if (NGVJ_OK != (rc = ngvj_storm_set(&ctx, bridge, pps))) {
+				(void) fprintf(stderr,
+				    ME ": Error: failed storm control: %s bridge: %s\n",
+				    bridge, ngvj_strerror(&ctx, rc)
+				);
+				exit(-1);
+			} else {
+				(void) fprintf(stdout,
+				    ME ": Success: storm control: %s bridge %ld pps\n",
+				    bridge, pps
+				);
+			}
+		}
+		if (1 == shards) return (0); /* done */
+		if (NGVJ_OK != (rc = ngvj_bridge_shard(&ctx, bridge, shards))) {
 			(void) fprintf(stderr,
-			    ME ": Error: failed to attatch: %s bridge <-> %s ether\n",
-			    bridge, ether
+			    ME ": Error: failed to shard: %s bridge: %s\n",
+			    bridge, ngvj_strerror(&ctx, rc)
 			);
 			exit(-1);
 		} else {
 			(void) fprintf(stdout,
-			    ME ": Success: attach: bridge %s <-> %s ether\n",
-			    bridge, ether
+			    ME ": Success: shard: %s bridge into %d\n", bridge, shards
 			);
 		}
 	}
@@ -321,7 +430,7 @@ main(int argc, char **argv)
 		err += NG_EXIST(bridge);
 		if (err) exit(-1);
 
-		if (0 != (rc = destroy_bridge(ngskt, bridge))) {
+		if (NGVJ_OK != (rc = ngvj_bridge_destroy(&ctx, bridge))) {
 			(void) fprintf(stderr,
 			    ME ": Error: failed to destroy: %s bridge\n", bridge
 			);
@@ -336,6 +445,183 @@ main(int argc, char **argv)
 			);
 		}
 	}
+	if (lflag) {
+		err += NG_EXIST(bridge);
+		if (err) exit(-1);
+
+		if (NGVJ_OK != (rc = ngvj_bridge_list(&ctx, bridge, print_link, NULL))) {
+			(void) fprintf(stderr,
+			    ME ": Error: failed to list: %s bridge: %s\n",
+			    bridge, ngvj_strerror(&ctx, rc)
+			);
+			exit(-1);
+		}
+	}
+	if (tflag) {
+		pcap_t			*pcap;
+		struct bpf_program	prog;
+		struct sigaction	sa;
+		int			rcvbuf = 1024 * 1024;
+
+		err += NG_EXIST(bridge);
+		if (err) exit(-1);
+
+		/* filter is compiled here, the kernel only ever sees bpf */
+		pcap = pcap_open_dead(DLT_EN10MB, TAP_SNAPLEN);
+		if (NULL != filter && -1 == pcap_compile(pcap, &prog, filter, 1,
+		    PCAP_NETMASK_UNKNOWN)) {
+			(void) fprintf(stderr,
+			    ME ": Error: filter: %s\n", pcap_geterr(pcap)
+			);
+			exit(-1);
+		}
+		/* a burst shouldn't be lost just because we were slow */
+		(void) setsockopt(ctx.dsock, SOL_SOCKET, SO_RCVBUF,
+		    &rcvbuf, sizeof(rcvbuf));
+
+		if (NGVJ_OK != (rc = ngvj_tap_insert(&ctx, bridge, hook,
+		    (NULL == filter) ? NULL : &prog))) {
+			(void) fprintf(stderr,
+			    ME ": Error: failed to tap: %s bridge %s: %s\n",
+			    bridge, hook, ngvj_strerror(&ctx, rc)
+			);
+			exit(-1);
+		} else {
+			(void) fprintf(stdout,
+			    ME ": Success: tap: %s bridge %s -> %s\n",
+			    bridge, hook, file
+			);
+		}
+		if (NULL != filter) pcap_freecode(&prog);
+
+		bzero(&sa, sizeof(sa));
+		sa.sa_handler = stop;
+		(void) sigaction(SIGINT, &sa, NULL);
+		(void) sigaction(SIGTERM, &sa, NULL);
+		(void) sigaction(SIGHUP, &sa, NULL);
+
+		if (0 != tap_capture(&ctx, pcap, file, limit * 1024 * 1024))
+			err = 1;
+		pcap_close(pcap);
+
+		/* fall into -u so the link goes back the way it was */
+		uflag = 1;
+	}
+	if (uflag) {
+		if (NGVJ_OK != (rc = ngvj_tap_remove(&ctx, bridge, hook))) {
+			(void) fprintf(stderr,
+			    ME ": Error: failed to untap: %s bridge %s\n",
+			    bridge, hook
+			);
+			exit(-1);
+		} else {
+			(void) fprintf(stdout,
+			    ME ": Success: untap: %s bridge %s\n", bridge, hook
+			);
+		}
+		if (err) exit(-1);
+	}
+	if (kflag) {
+		err += NG_EXIST(bridge);
+		if (err) exit(-1);
+
+		if (NGVJ_OK != (rc = ngvj_bridge_tunnel(&ctx, bridge, local->ai_addr,
+		    peer->ai_addr, uplink, sizeof(uplink)))) {
+			(void) fprintf(stderr,
+			    ME ": Error: failed to tunnel: %s bridge <-> %s port %s: %s\n",
+			    bridge, argv[5], argv[6], ngvj_strerror(&ctx, rc)
+			);
+			exit(-1);
+		} else {
+			(void) fprintf(stdout,
+			    ME ": Success: tunnel: %s bridge %s <-> %s port %s\n",
+			    bridge, uplink, argv[5], argv[6]
+			);
+		}
+		freeaddrinfo(local);
+		freeaddrinfo(peer);
+	}
+	if (bflag) {
+		struct ngvj_storm	st;
+
+		err += NG_EXIST(bridge);
+		if (err) exit(-1);
+
+		if (-1 != pps && NGVJ_OK != (rc = ngvj_storm_set(&ctx, bridge, pps))) {
+			(void) fprintf(stderr,
+			    ME ": Error: failed storm control: %s bridge: %s\n",
+			    bridge, ngvj_strerror(&ctx, rc)
+			);
+			exit(-1);
+		}
+		if (0 == pps) {
+			(void) fprintf(stdout,
+			    ME ": Success: storm control: %s bridge off\n", bridge
+			);
+		} else if (NGVJ_OK != (rc = ngvj_storm_stats(&ctx, bridge, &st))) {
+			(void) fprintf(stderr,
+			    ME ": Error: %s bridge storm control: %s\n",
+			    bridge, ngvj_strerror(&ctx, rc)
+			);
+			exit(-1);
+		} else {
+			(void) fprintf(stdout,
+			    "%s %ju pps %ju passed %ju dropped\n", bridge,
+			    (uintmax_t) st.pps, (uintmax_t) st.passed,
+			    (uintmax_t) st.dropped
+			);
+		}
+	}
+
+	if (aflag) {
+		struct ngvj_proxy_stats	st;
+		struct sigaction	sa;
+		int			rcvbuf = 1024 * 1024;
+
+		err += NG_EXIST(bridge);
+		if (err) exit(-1);
+
+		/* every jail starting at once asks about its gateway at once */
+		(void) setsockopt(ctx.dsock, SOL_SOCKET, SO_RCVBUF,
+		    &rcvbuf, sizeof(rcvbuf));
+
+		if (NGVJ_OK != (rc = ngvj_proxy_start(&ctx, bridge))) {
+			(void) fprintf(stderr,
+			    ME ": Error: failed to proxy: %s bridge: %s\n",
+			    bridge, ngvj_strerror(&ctx, rc)
+			);
+			exit(-1);
+		} else {
+			(void) fprintf(stdout,
+			    ME ": Success: proxy: %s bridge\n", bridge
+			);
+		}
+
+		bzero(&sa, sizeof(sa));
+		sa.sa_handler = stop;
+		(void) sigaction(SIGINT, &sa, NULL);
+		(void) sigaction(SIGTERM, &sa, NULL);
+		(void) sigaction(SIGHUP, &sa, NULL);
+
+		while (running) {
+			if (NGVJ_OK != (rc = ngvj_proxy_run(&ctx, 1000))) {
+				(void) fprintf(stderr,
+				    ME ": Error: proxy: %s bridge: %s\n",
+				    bridge, ngvj_strerror(&ctx, rc)
+				);
+				err = 1;
+				break;
+			}
+		}
+		(void) ngvj_proxy_stats(&ctx, &st);
+		(void) ngvj_proxy_stop(&ctx);
+		(void) fprintf(stdout,
+		    ME ": Success: proxy: %s bridge %ju answered %ju forwarded\n",
+		    bridge, (uintmax_t) st.answered, (uintmax_t) st.forwarded
+		);
+		if (err) exit(-1);
+	}
 
+	ngvj_close(&ctx);
 	return (0);
 }
@@ -22,216 +22,17 @@
  * SOFTWARE.
  */
 
-#include "common.h"
+#include "cli.h"
 
-#include <net/ethernet.h>
-#include <netgraph/ng_bridge.h>
-#include <sys/ioctl.h>
-#include <net/if_dl.h>
+#include <arpa/inet.h>
 
-#define	LLNAMSIZ	18
-
-/* FUNCTIONS */
-
-/* we just use "link" which will give us the lowest hook */
-static int
-create_eiface(int ngs, const char *bridge, const char *eiface)
-{
-	int rc, skt;
-	struct ngm_name nm;
-	struct ngm_rmhook rm = {
-		.ourhook = "ether"
-	};
-	struct ngm_mkpeer mp = {
-		.type = "eiface",
-		.ourhook = "lower", /* was "linkN", */
-		.peerhook = "ether"
-	};
-	struct ngm_connect cn = {
-		/* .path = eiface, */
-		.ourhook = "link",
-		.peerhook = "ether",
-	};
-	struct ng_mesg	*resp;
-	struct nodeinfo *ninfo;
-	struct ifreq	ifr;
-
-	/* create it connected to our ngs, this lets us find it */
-	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
-		return (-1);
-
-	/* but we do need to know what name it got to change the interface name for ifconfig */
-        rc = NgSendMsg(ngs, ".:lower", NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0);
-        if (-1 == rc) {
-		(void) fprintf(stderr, "failed nodeinfo\n");
-		return (-1);
-	}
-
-        rc = NgAllocRecvMsg(ngs, &resp, NULL);
-        if (-1 == rc) {
-		(void) fprintf(stderr, "failed nodeinfo:recvmsg\n");
-		return (-1);
-	}
-	ninfo = (struct nodeinfo *) resp->data;
-	(void) strlcpy(nm.name, eiface, sizeof(nm.name));
-	*(nm.name + strlen(nm.name) - 1) = '\0'; /* remove ':' */
-
-	strncpy(ifr.ifr_name, ninfo->name, sizeof(ifr.ifr_name));
-	ifr.ifr_data = nm.name;
-	free(resp);
-
-	if (-1 == NgSendMsg(ngs, ".:lower", NGM_GENERIC_COOKIE, NGM_NAME, &nm, sizeof(nm))) {
-		(void) fprintf(stderr, "failed rename\n");
-		return (-1);
-	}
-
-	if (-1 == NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm))) {
-		(void) fprintf(stderr, "failed un-hook\n");
-		return (-1);
-	}
-
-	(void) strlcpy(cn.path, eiface, sizeof(cn.path));
-	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn))) {
-		(void) fprintf(stderr, "failed connection\n");
-		return (-1);
-	}
-
-	// rename interface too
-	if (-1 == (skt = socket(AF_LOCAL, SOCK_DGRAM, 0))) {
-		(void) fprintf(stderr, "failed socket\n");
-		return (-1);
-	}
-	if (-1 == ioctl(skt, SIOCSIFNAME, &ifr)) {
-		(void) fprintf(stderr, "failed ioctl\n");
-		return (-1);
-	}
-
-        (void) close(skt);
-
-	return (0); 
-}
-
-static int
-destroy_eiface(int ngs, const char *eiface)
-{
-	int		rc, idx;
-	struct ng_mesg	*resp;
-	struct hooklist *hlist;
-	struct nodeinfo	*ninfo;
-
-	rc = NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE, NGM_LISTHOOKS, NULL, 0);
-	if (-1 == rc) return (-1);
-	if (-1 == NgAllocRecvMsg(ngs, &resp, NULL)) return (-1);
-
-	hlist = (struct hooklist *) resp->data;
-	ninfo = &hlist->nodeinfo;
-
-	/* all interfaces can be removed, there is one or zero ... */
-	for (idx = 0; idx < ninfo->hooks; idx++) {
-		struct linkinfo *const link = &hlist->link[idx];
-		rc = NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE,
-		    NGM_RMHOOK, link, sizeof(struct ngm_rmhook));
-	}
-
-	rc = NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
-
-	return (0);
-}
-
-/*
- * A valid mac string is "bb:bb:bb:bb:bb:bb", where b is a char 0-9a-fA-F.
- * Not checking that it is un-used on this system, much less that it isn't
- * in the ARP cache. Besides that cache may be incomplete. Its your job to
- * pick something unique! This just lets us give a useful error when the
- * mac string isn't right.
- */
-static int
-validate_mac(const char *mac)
-{
-	const char	*end;
-
-	if (NULL == mac) return (0);
-
-	if (17 != strlen(mac)) return (-1);
-	end = mac + 17;
-
-# define MAC_ERR { \
-		(void) fprintf(stderr, \
-		    ME ": Error: invalid mac address\n" \
-		); \
-		return (-1); \
-	}
-
-	/*
-	 * Seems like sscanf could work with a %x, but '0x' will scan to 0.
-	 */
-#	define HX_CHECK(p) ( \
-		'0' == *p || '1' == *p || '2' == *p || '3' == *p || \
-		'4' == *p || '5' == *p || '6' == *p || '7' == *p || \
-		'8' == *p || '9' == *p || 'a' == *p || 'b' == *p || \
-		'c' == *p || 'd' == *p || 'e' == *p || 'f' == *p || \
-		'A' == *p || 'B' == *p || 'C' == *p || 'D' == *p || \
-		'E' == *p || 'F' == *p \
-	)
-	while (mac < end) {
-		if (!HX_CHECK(mac)) MAC_ERR
-		mac++;
-		if (!HX_CHECK(mac)) MAC_ERR
-		mac++;
-		if (mac != end && ':' != *mac) MAC_ERR
-		mac++;
-	}
-
-	return (0);
-}
-
-static int
-set_mac(char *name, char *mac)
-{
-	int			skt;
-	struct sockaddr_dl	sdl;
-	struct ifreq		ifr;
-	struct sockaddr		*sa;
-	char			temp[LLNAMSIZ + 1];
-
-	sa = &ifr.ifr_addr;
-
-	temp[0] = ':';
-	strcpy(temp + 1, mac);
-	sdl.sdl_len = sizeof(sdl);
-	link_addr(temp, &sdl);
-	if (sdl.sdl_alen > sizeof(sa->sa_data)) {
-		errno = EINVAL;  /* malformed mac */
-		return (-1);
-	}
-	sa->sa_family = AF_LINK;
-	sa->sa_len = sdl.sdl_alen;
-	bcopy(LLADDR(&sdl), sa->sa_data, sdl.sdl_alen);
-
-	if (-1 == (skt = socket(AF_LOCAL, SOCK_DGRAM, 0)))
-		return (-1);
-	/*
-	 * Unfortunately this is one time we don't want ':' on the end of the name.
-	 * But for sake of consistent args to functions we will remove it rather than
-	 * pass in a different string here.
-	 */
-	strncpy(temp, name, sizeof(temp));
-	*(temp + strlen(temp) - 1) = '\0'; /* remove ':' */
-	strncpy(ifr.ifr_name, temp, sizeof(ifr.ifr_name));
-
-	if (-1 == ioctl(skt, SIOCSIFLLADDR, &ifr)) {
-		(void) close(skt);
-		return (-1);
-	}
-
-	(void) close(skt);
-	return (0);
-}
+#define	ADDRS_MAX	16	/* -i given more often than this is a mistake */
 
 #define USAGE { \
 	(void) fprintf(stderr, \
-		"usage: " ME " -c <bridge> <eiface> <mac address>\n" \
+		"usage: " ME " -c <bridge> <eiface> <mac address> [-w seconds] [-i addr ...] [-g count]\n" \
 		"       " ME " -d <eiface>\n" \
+		"       " ME " -m <bridge> <eiface>\n" \
 	); \
 	exit(-1); \
 }
@@ -240,27 +41,50 @@ set_mac(char *name, char *mac)
 int
 main(int argc, char **argv)
 {
-	int	rc, err, ngskt, cflag, dflag;
-	char	*bridge, *eiface, *mac;
-	char	ngpath[2][NG_PATHSIZ];
+	int	rc, err, cflag, dflag, mflag, wait, idx, naddr, garp;
+	char	*bridge, *eiface, *mac, *end;
+	char	*addr[ADDRS_MAX];
+	struct ngvj_ctx ctx;
 
-	ngskt = -1;
 	cflag = 0;
 	dflag = 0;
+	mflag = 0;
+	wait = 0;
+	naddr = 0;
+	garp = 0;
 
 	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
 	/* valid args
-	 *	ng-eiface -c brname ifname macaddr
+	 *	ng-eiface -c brname ifname macaddr [-w seconds] [-i addr ...] [-g count]
 	 *	ng-bridge -d ifname
+	 *	ng-eiface -m brname ifname
 	 */
 	if (argc < 3) USAGE;
 
 	if (0 == strcmp(argv[1], "-c")) {
-		if (5 != argc) USAGE;
+		if (argc < 5) USAGE;
 		bridge = argv[2];
 		eiface = argv[3];
 		mac = argv[4];
+		for (idx = 5; idx < argc; idx++) {
+			if (0 == strcmp(argv[idx], "-w") && idx + 1 < argc) {
+				wait = (int) strtol(argv[++idx], &end, 10);
+				if ('\0' != *end || wait < 1) USAGE;
+			} else if (0 == strcmp(argv[idx], "-i") && idx + 1 < argc &&
+			    naddr < ADDRS_MAX) {
+				addr[naddr++] = argv[++idx];
+			} else if (0 == strcmp(argv[idx], "-g") && idx + 1 < argc) {
+				garp = (int) strtol(argv[++idx], &end, 10);
+				if ('\0' != *end || garp < 1 ||
+				    garp > NGVJ_ANNOUNCE_MAX)
+					USAGE;
+			} else {
+				USAGE;
+			}
+		}
+		/* the -i addresses are what gets announced */
+		if (garp && 0 == naddr) USAGE;
 		cflag = 1;
 	}
 	if (0 == strcmp(argv[1], "-d")) {
@@ -270,9 +94,17 @@ main(int argc, char **argv)
 		mac = NULL;
 		dflag = 1;
 	}
-	if (0 == (cflag | dflag)) {
+	if (0 == strcmp(argv[1], "-m")) {
+		if (4 != argc) USAGE;
+		bridge = argv[2];
+		eiface = argv[3];
+		mac = NULL;
+		mflag = 1;
+	}
+	if (0 == (cflag | dflag | mflag)) {
 		(void) fprintf(stderr,
-		    ME ": Error: \"%s\" must be \"-c\" or \"-d\"\n\n", argv[1]
+		    ME ": Error: \"%s\" must be \"-c\", \"-d\" or \"-m\"\n\n",
+		    argv[1]
 		);
 		USAGE;
 	}
@@ -280,17 +112,33 @@ main(int argc, char **argv)
 	err = 0;
 	VALIDATE_NODE(bridge);
 	VALIDATE_NODE(eiface);
-	err += validate_mac(mac);
+	if (NULL != mac && NGVJ_OK != ngvj_valid_mac(mac)) {
+		err = 1;
+		(void) fprintf(stderr, ME ": Error: invalid mac address\n");
+	}
+	for (idx = 0; idx < naddr; idx++) {
+		u_char	buf[16];
+
+		if (1 != inet_pton(AF_INET, addr[idx], buf) &&
+		    1 != inet_pton(AF_INET6, addr[idx], buf)) {
+			err = 1;
+			(void) fprintf(stderr,
+			    ME ": Error: invalid address %s\n", addr[idx]
+			);
+		}
+	}
 	if (err) {
 		(void) fprintf(stderr, "\n");
 		USAGE;
 	}
-	COPY_NAME(eiface, ngpath[0]);
-	COPY_NAME(bridge, ngpath[1]);
 
 	/* input valid, no longer give USAGE on error */
 
-	ngskt = create_ng_sock();
+	/*
+	 * The routing socket is opened before the eiface exists, see -w. -g
+	 * sends its frames from our socket node, which needs the data socket.
+	 */
+	open_ctx(&ctx, (wait ? NGVJ_ROUTE : 0) | (garp ? NGVJ_DATA : 0));
 
 	/*
 	 * These checks are racy, interface names come and go along with
@@ -306,10 +154,10 @@ main(int argc, char **argv)
 		err += NG_NOTEXIST(eiface);
 		if (err) exit(-1);
 
-		if (0 != (rc = create_eiface(ngskt, bridge, eiface))) {
+		if (NGVJ_OK != (rc = ngvj_eiface_create(&ctx, bridge, eiface))) {
 			(void) fprintf(stderr,
-			    ME ": Error: failed to create %s eiface\n",
-			    eiface
+			    ME ": Error: failed to create %s eiface: %s\n",
+			    eiface, ngvj_strerror(&ctx, rc)
 			);
 			exit(-1);
 		} else {
@@ -318,18 +166,64 @@ main(int argc, char **argv)
 				ME ": Success: create: %s eiface\n", eiface
 			);
 		}
-		if (0 != (rc = set_mac(eiface, mac))) {
+		if (NGVJ_OK != (rc = ngvj_eiface_set_mac(&ctx, eiface, mac))) {
 			(void) fprintf(stderr,
-			    ME ": Error: failed to set mac %s eiface\n",
-			    eiface
+			    ME ": Error: failed to set mac %s eiface: %s\n",
+			    eiface, ngvj_strerror(&ctx, rc)
 			);
+			exit(-1);
+		}
+		/* before -w, so the link is up for good when that says so */
+		if (garp) {
+			rc = ngvj_eiface_announce(&ctx, eiface, mac,
+			    (const char * const *) addr, naddr, garp);
+			if (NGVJ_OK != rc) {
+				(void) fprintf(stderr,
+				    ME ": Error: failed to announce %s eiface: %s\n",
+				    eiface, ngvj_strerror(&ctx, rc)
+				);
+				exit(-1);
+			} else {
+				(void) fprintf(stdout,
+				    ME ": Success: announce: %s eiface\n", eiface
+				);
+			}
+		}
+		if (wait) {
+			if (NGVJ_OK != (rc = ngvj_eiface_wait(&ctx, eiface, mac, wait))) {
+				(void) fprintf(stderr,
+				    ME ": Error: %s eiface not ready: %s\n",
+				    eiface, ngvj_strerror(&ctx, rc)
+				);
+				exit(-1);
+			} else {
+				(void) fprintf(stdout,
+				    ME ": Success: ready: %s eiface\n", eiface
+				);
+			}
+		}
+		/* tell the bridge's proxy, if there is one, what is behind it */
+		for (idx = 0; idx < naddr; idx++) {
+			rc = ngvj_proxy_bind(&ctx, bridge, eiface, mac, addr[idx]);
+			if (NGVJ_ENOENT == rc) {
+				(void) fprintf(stdout,
+				    ME ": Note: no proxy on %s bridge\n", bridge
+				);
+				break;
+			} else if (NGVJ_OK != rc) {
+				(void) fprintf(stderr,
+				    ME ": Error: failed to bind %s to %s eiface: %s\n",
+				    addr[idx], eiface, ngvj_strerror(&ctx, rc)
+				);
+				exit(-1);
+			}
 		}
 	}
 	if (dflag) {
 		err += NG_EXIST(eiface);
 		if (err) exit(-1);
 
-		if (0 != (rc = destroy_eiface(ngskt, eiface))) {
+		if (NGVJ_OK != (rc = ngvj_eiface_destroy(&ctx, eiface))) {
 			(void) fprintf(stderr,
 			    ME ": Error: failed to destry: %s eiface\n", eiface
 			);
@@ -340,6 +234,25 @@ main(int argc, char **argv)
 			);
 		}
 	}
+	if (mflag) {
+		err += NG_EXIST(bridge);
+		err += NG_EXIST(eiface);
+		if (err) exit(-1);
+
+		if (NGVJ_OK != (rc = ngvj_eiface_move(&ctx, bridge, eiface))) {
+			(void) fprintf(stderr,
+			    ME ": Error: failed to move: %s eiface to %s bridge: %s\n",
+			    eiface, bridge, ngvj_strerror(&ctx, rc)
+			);
+			exit(-1);
+		} else {
+			(void) fprintf(stdout,
+			    ME ": Success: move: %s eiface to %s bridge\n",
+			    eiface, bridge
+			);
+		}
+	}
 
+	ngvj_close(&ctx);
 	return (0);
 }
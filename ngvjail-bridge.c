@@ -0,0 +1,1171 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "common.h"
+
+#include <net/bpf.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netgraph/ng_bpf.h>
+#include <netgraph/ng_bridge.h>
+#include <netgraph/ng_car.h>
+#include <netgraph/ng_ether.h>
+#include <netgraph/ng_ksocket.h>
+#include <netgraph/ng_tee.h>
+
+static int
+ether_is_connected(int ngs, const char *ether)
+{
+	int		rc, idx;
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct nodeinfo	*ninfo;
+
+	rc = ng_list_hooks(ngs, ether, &resp);
+	if (-1 == rc) return (-1);
+	
+	hlist = (struct hooklist *) resp->data;
+	ninfo = &hlist->nodeinfo;
+
+	rc = 0;
+	for (idx = 0; idx < ninfo->hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+		if ('\0' != *link->peerhook) rc++;
+	}
+	free(resp);
+	return (rc);
+}
+
+
+/*
+ * Connecting an ethernet interface means connecting the lower and upper hooks
+ * to the bridge. This does mean it takes up 2 hooks, not just one.
+ *
+ * This is only called on newly created bridges. This means link0 and link1
+ * are free and should be used on the bridge.
+ */
+static int
+connect_ether(int ngs, const char *bridge, const char *ether)
+{
+	int			rc;
+	static const int	mode = 1;
+	struct ngm_connect	cn[] = {
+		{
+#	define UP	0
+			.ourhook = "upper",
+			.peerhook = "link0"
+		},{
+#	define LO	1
+			.ourhook = "lower",
+			.peerhook = "uplink1" /* new feature */
+		}
+	};
+
+	strlcpy(cn[LO].path, bridge, sizeof(cn[LO].path));
+	strlcpy(cn[UP].path, bridge, sizeof(cn[UP].path));
+
+	/* we need to have the iface in promisc mode */
+	rc = NgSendMsg(ngs, ether, NGM_ETHER_COOKIE,
+		    NGM_ETHER_SET_PROMISC, &mode, sizeof(mode));
+	if (-1 == rc) return (-1); /* must be able to put in this mode */
+
+	/* return positive int ... */
+	(void) NgSendMsg(ngs, ether, NGM_GENERIC_COOKIE,
+	    NGM_CONNECT, &cn[UP], sizeof(cn[UP]));
+	(void) NgSendMsg(ngs, ether, NGM_GENERIC_COOKIE,
+	    NGM_CONNECT, &cn[LO], sizeof(cn[LO]));
+	return (0);
+}
+
+
+/* netgraph doesn't distinguish between logical and physical */
+static int
+create_bridge(int ngs, const char *bridge)
+{
+	struct ngm_name nm;
+	struct ngm_rmhook rm = {
+		.ourhook = "link0"
+	};
+	struct ngm_mkpeer mp = {
+		.type = "bridge",
+		.ourhook = "lower",
+		.peerhook = "link0" /* always starts at 0 -- but nothing connected yet */
+	};
+
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
+		return (-1);
+
+	/*
+	 * Unfortunately this is one time we don't want ':' on the end of the name.
+	 * But for sake of consistent args to functions we will remove it rather than
+	 * pass in a different string here.
+	 */
+	(void) strlcpy(nm.name, bridge, sizeof(nm.name));
+	*(nm.name + strlen(nm.name) - 1) = '\0'; /* remove ':' */
+	if (-1 == NgSendMsg(ngs, ".:lower", NGM_GENERIC_COOKIE, NGM_NAME, &nm, sizeof(nm)))
+		return (-1);
+
+	/* need to set NGM_BRIDGE_SET_PERSISTENT so it stays! */
+	if (-1 == NgSendMsg(ngs, bridge, NGM_BRIDGE_COOKIE, NGM_BRIDGE_SET_PERSISTENT, NULL, 0))
+		return (-1);
+
+	/* this socket is connected to link0, disconnect from it */
+	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm)))
+		return (-1);
+
+	return (0);
+}
+
+
+/*
+ * Any connected nodes are removed. For eiface this would be like having the
+ * cat5 pulled out. They will still need `ng-eiface -d` to destroy them.
+ */
+static int
+destroy_bridge(int ngs, const char *bridge)
+{
+	int		rc, idx;
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct nodeinfo *ninfo;
+	
+	rc = ng_list_hooks(ngs, bridge, &resp);
+	if (-1 == rc) return (-1);
+	
+	hlist = (struct hooklist *) resp->data;
+	ninfo = &hlist->nodeinfo;
+
+#if	0
+	/* this was checked in ngvj_bridge_destroy() already ... */
+	if (0 != strcmp(ninfo->type, "bridge")) {
+		free(resp);
+		return (-1);
+	}
+#	endif
+
+
+	/* all interfaces can be removed, if link0 is ether then set promisc off */
+	for (idx = 0; idx < ninfo->hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+		const char *type = link->nodeinfo.type;
+		char path[NG_PATHSIZ];
+
+		/*
+		 * A tap is shut down rather than disconnected, ng_tee puts the
+		 * bridge and whatever was on the other side back together when
+		 * it goes. That hook is then removed like any other.
+		 */
+		if (0 == strcmp(type, "tee")) {
+			(void) snprintf(path, sizeof(path), "[%x]:",
+			    link->nodeinfo.id
+			);
+			rc = NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+			    NGM_SHUTDOWN, NULL, 0);
+			(void) snprintf(path, sizeof(path), "%s%s",
+			    bridge, link->ourhook
+			);
+			type = ng_type(ngs, path);
+		}
+
+		/*
+		 * Storm control, the car is on the bpf's "storm" hook. The
+		 * ether is left with nothing on its lower hook, which is how
+		 * it started out. It is only ever on uplink1, a bpf anywhere
+		 * else is not ours to take apart like this.
+		 */
+		if (NULL != type && 0 == strcmp(type, "bpf") &&
+		    0 == strcmp(link->ourhook, "uplink1")) {
+			(void) snprintf(path, sizeof(path), "[%x]:storm",
+			    link->nodeinfo.id
+			);
+			rc = NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+			    NGM_SHUTDOWN, NULL, 0);
+			(void) snprintf(path, sizeof(path), "[%x]:",
+			    link->nodeinfo.id
+			);
+			rc = NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+			    NGM_SHUTDOWN, NULL, 0);
+		}
+
+		/*
+		 * The proxy's bpf, which has the one2many on its "q" hook.
+		 * Both go so the eiface is left unconnected, like a plain link.
+		 */
+		if (NULL != type && 0 == strcmp(type, "bpf") &&
+		    0 == strcmp(link->peerhook, "b")) {
+			(void) snprintf(path, sizeof(path), "[%x]:q",
+			    link->nodeinfo.id
+			);
+			rc = NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+			    NGM_SHUTDOWN, NULL, 0);
+			(void) snprintf(path, sizeof(path), "[%x]:",
+			    link->nodeinfo.id
+			);
+			rc = NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+			    NGM_SHUTDOWN, NULL, 0);
+		}
+
+		/* remove promisc mode, while we can still reach the ether */
+		if ((NULL != type) && (0 == strcmp(type, "ether")) &&
+		    (0 == strcmp(link->ourhook, "link0"))) {
+			int prom = 0;
+
+			(void) snprintf(path, sizeof(path), "%s%s",
+			    bridge, link->ourhook
+			);
+			rc = NgSendMsg(ngs, path, NGM_ETHER_COOKIE,
+				    NGM_ETHER_SET_PROMISC, &prom, sizeof(prom));
+		}
+
+		/*
+		 * going to cheat, we can cast link to be an ngm_rmhook
+		 * because all an ngm_rmhook has is the ourhook char array
+		 * and that is the first thing in a linkinfo
+		 */
+		rc = NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE,
+		    NGM_RMHOOK, link, sizeof(struct ngm_rmhook));
+	}
+	free(resp);
+
+	/* send shutdown for our bridge, since we set persist */
+	rc = NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+
+	return (0);
+}
+
+
+/*
+ * Shard 0 was already made by create_bridge() (and has its ether if there is
+ * one). Make the rest and trunk each of them to shard 0 with a plain link so
+ * MAC learning works across the trunk in both directions.
+ */
+static int
+create_shards(int ngs, const char *bridge, int shards)
+{
+	int			shard, made, err;
+	char			path[NG_PATHSIZ];
+	struct ngm_connect	cn = {
+		.ourhook = "link",
+		.peerhook = "link"
+	};
+
+	made = 0;
+	for (shard = 1; shard < shards; shard++) {
+		shard_path(path, sizeof(path), bridge, shard);
+		if (-1 == create_bridge(ngs, path))
+			goto fail;
+		made = shard;
+		(void) strlcpy(cn.path, path, sizeof(cn.path));
+		if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE,
+		    NGM_CONNECT, &cn, sizeof(cn)))
+			goto fail;
+	}
+	return (0);
+
+fail:
+	/* only the ones we made, not whatever was in the way */
+	err = errno;
+	for (shard = 1; shard <= made; shard++) {
+		shard_path(path, sizeof(path), bridge, shard);
+		(void) NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+		    NGM_SHUTDOWN, NULL, 0);
+	}
+	errno = err;
+	return (-1);
+}
+
+
+/*
+ * Destroying shard 0 first takes all the trunks with it, then each of the
+ * other shards is just an ordinary bridge with eifaces to disconnect.
+ */
+static int
+destroy_shards(int ngs, const char *bridge)
+{
+	int	rc, shards, shard;
+	char	path[NG_PATHSIZ];
+
+	shards = shard_count(ngs, bridge);
+	rc = 0;
+	for (shard = 0; shard < shards; shard++) {
+		shard_path(path, sizeof(path), bridge, shard);
+		if (-1 == destroy_bridge(ngs, path))
+			rc = -1;
+	}
+	return (rc);
+}
+
+
+/*
+ * cb gets every link on every shard: shard, hook, peer and its type. Unnamed
+ * peers (taps, tunnels) are given by ID the way ngctl(8) would. It can stop
+ * the listing early by returning anything but 0.
+ */
+static int
+list_bridge(int ngs, const char *bridge, ngvj_link_cb cb, void *arg)
+{
+	int		idx, shards, shard, stop;
+	char		path[NG_PATHSIZ], peer[NG_NODESIZ + 2];
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct nodeinfo *ninfo;
+	struct ngvj_link nl;
+
+	stop = 0;
+	shards = shard_count(ngs, bridge);
+	for (shard = 0; shard < shards && !stop; shard++) {
+		shard_path(path, sizeof(path), bridge, shard);
+		if (-1 == ng_list_hooks(ngs, path, &resp)) return (-1);
+
+		hlist = (struct hooklist *) resp->data;
+		ninfo = &hlist->nodeinfo;
+		for (idx = 0; idx < ninfo->hooks && !stop; idx++) {
+			struct linkinfo *const link = &hlist->link[idx];
+
+			if ('\0' != *link->nodeinfo.name)
+				(void) strlcpy(peer, link->nodeinfo.name, sizeof(peer));
+			else
+				(void) snprintf(peer, sizeof(peer), "[%x]",
+				    link->nodeinfo.id
+				);
+			nl.shard = ninfo->name;
+			nl.hook = link->ourhook;
+			nl.peer = peer;
+			nl.type = link->nodeinfo.type;
+			stop = cb(&nl, arg);
+		}
+		free(resp);
+	}
+	return (0);
+}
+
+
+/*
+ * Find what is on the other end of bridge:hook. peer is filled in as an ID
+ * path, peerhook and type must have room for NG_HOOKSIZ and NG_TYPESIZ.
+ */
+static int
+hook_peer(int ngs, const char *bridge, const char *hook,
+    char *peer, size_t len, char *peerhook, char *type)
+{
+	int		idx;
+	ng_ID_t		id;
+	char		path[NG_PATHSIZ];
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct nodeinfo *ninfo;
+
+	if (-1 == ng_ask(ngs, bridge, NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0,
+	    &resp))
+		return (-1);
+	id = ((struct nodeinfo *) resp->data)->id;
+	free(resp);
+
+	/* the peer has only a hook or two, so ask it rather than the bridge */
+	(void) snprintf(path, sizeof(path), "%s%s", bridge, hook);
+	if (-1 == ng_list_hooks(ngs, path, &resp)) return (-1);
+
+	hlist = (struct hooklist *) resp->data;
+	ninfo = &hlist->nodeinfo;
+	(void) snprintf(peer, len, "[%x]:", ninfo->id);
+	(void) strlcpy(type, ninfo->type, NG_TYPESIZ);
+
+	for (idx = 0; idx < ninfo->hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+
+		if (link->nodeinfo.id == id &&
+		    0 == strcmp(link->peerhook, hook)) {
+			(void) strlcpy(peerhook, link->ourhook, NG_HOOKSIZ);
+			free(resp);
+			return (0);
+		}
+	}
+	free(resp);
+	errno = ENOENT;
+	return (-1);
+}
+
+
+/* a half made tap, the bpf is only there with a filter */
+static void
+tap_shutdown(int ngs, const char *tee, const struct bpf_program *filter)
+{
+	(void) NgSendMsg(ngs, tee, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	if (NULL != filter)
+		(void) NgSendMsg(ngs, ".:tap", NGM_GENERIC_COOKIE,
+		    NGM_SHUTDOWN, NULL, 0);
+}
+
+
+/*
+ * A tap splices an ng_tee into a single bridge link
+ *
+ *	bridge:<hook> <-> left [tee] right <-> eiface, ether or bpf
+ *
+ * and brings the left2right and right2left copies up to our socket. With a
+ * filter they go through an ng_bpf first so unwanted frames are dropped in
+ * the kernel instead of being copied out to us. No other link on the bridge
+ * is touched, and until the tap is in place neither is this one. Whatever
+ * goes wrong the tee and bpf are shut down, they would otherwise keep each
+ * other alive after our socket is gone.
+ */
+static int
+tap_insert(int ngs, const char *bridge, const char *hook,
+    const struct bpf_program *filter)
+{
+	int			err;
+	const char		*tee;
+	char			peer[NG_PATHSIZ], teeid[NG_PATHSIZ];
+	char			peerhook[NG_HOOKSIZ], type[NG_TYPESIZ];
+	struct ng_mesg		*resp;
+	struct ngm_rmhook	rm;
+	struct ngm_mkpeer	mp = {
+		.type = "tee",
+		.ourhook = "l2r",
+		.peerhook = "left2right"
+	};
+	struct ngm_mkpeer	bp = {
+		.type = "bpf",
+		.ourhook = "tap",
+		.peerhook = "match"
+	};
+	struct ngm_connect	cn = {
+		.path = "l2r",
+		.ourhook = "r2l",
+		.peerhook = "right2left"
+	};
+
+	if (-1 == hook_peer(ngs, bridge, hook, peer, sizeof(peer), peerhook, type))
+		return (-1);
+	if (0 == strcmp(type, "tee")) {
+		errno = EEXIST; /* already tapped */
+		return (-1);
+	}
+	/* a bpf is the proxy's or storm control's, tap its bridge side */
+	if (0 != strcmp(type, "eiface") && 0 != strcmp(type, "ether") &&
+	    0 != strcmp(type, "bpf")) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* hang the tee off our socket, or off the bpf hung off our socket */
+	if (NULL == filter) {
+		tee = ".:l2r";
+		if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE,
+		    NGM_MKPEER, &mp, sizeof(mp)))
+			return (-1);
+		if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE,
+		    NGM_CONNECT, &cn, sizeof(cn)))
+			goto fail;
+	} else {
+		tee = ".:tap.l2r";
+		if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE,
+		    NGM_MKPEER, &bp, sizeof(bp)))
+			return (-1);
+		if (-1 == NgSendMsg(ngs, ".:tap", NGM_GENERIC_COOKIE,
+		    NGM_MKPEER, &mp, sizeof(mp)))
+			goto fail;
+		if (-1 == NgSendMsg(ngs, ".:tap", NGM_GENERIC_COOKIE,
+		    NGM_CONNECT, &cn, sizeof(cn)))
+			goto fail;
+		if (-1 == set_bpf_prog(ngs, ".:tap", "l2r", "match", "",
+		    filter->bf_insns, filter->bf_len))
+			goto fail;
+		if (-1 == set_bpf_prog(ngs, ".:tap", "r2l", "match", "",
+		    filter->bf_insns, filter->bf_len))
+			goto fail;
+	}
+
+	if (-1 == ng_ask(ngs, tee, NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0, &resp))
+		goto fail;
+	(void) snprintf(teeid, sizeof(teeid), "[%x]:",
+	    ((struct nodeinfo *) resp->data)->id
+	);
+	free(resp);
+	tee = teeid;
+
+	/* now the only part anybody on the bridge can notice */
+	(void) strlcpy(rm.ourhook, hook, sizeof(rm.ourhook));
+	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE,
+	    NGM_RMHOOK, &rm, sizeof(rm)))
+		goto fail;
+
+	(void) strlcpy(cn.path, teeid, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, hook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "left", sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE,
+	    NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+
+	(void) strlcpy(cn.ourhook, peerhook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "right", sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, peer, NGM_GENERIC_COOKIE,
+	    NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+
+	return (0);
+
+restore:
+	/*
+	 * Put the link back the way it was. The tee has at most its left
+	 * hook on the bridge, and that goes first so shutting the tee down
+	 * can't join anything up on its way out.
+	 */
+	err = errno;
+	(void) NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE,
+	    NGM_RMHOOK, &rm, sizeof(rm));
+	tap_shutdown(ngs, tee, filter);
+	(void) strlcpy(cn.path, peer, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, hook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, peerhook, sizeof(cn.peerhook));
+	(void) NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE,
+	    NGM_CONNECT, &cn, sizeof(cn));
+	errno = err;
+	return (-1);
+
+fail:
+	err = errno;
+	tap_shutdown(ngs, tee, filter);
+	errno = err;
+	return (-1);
+}
+
+
+/*
+ * Shutting down the tee is all it takes, ng_tee reconnects left and right
+ * directly as it goes and a bpf with no hooks left removes itself.
+ */
+static int
+tap_remove(int ngs, const char *bridge, const char *hook)
+{
+	const char	*type;
+	char		path[NG_PATHSIZ];
+
+	(void) snprintf(path, sizeof(path), "%s%s", bridge, hook);
+	if (NULL == (type = ng_type(ngs, path))) return (-1);
+	if (0 != strcmp(type, "tee")) {
+		errno = ENOENT;
+		return (-1);
+	}
+	if (-1 == NgSendMsg(ngs, path, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0))
+		return (-1);
+	return (0);
+}
+
+
+/*
+ * A tunnel is an ng_ksocket UDP socket on an uplink of the bridge, every
+ * frame the bridge sends up it goes to the peer as one datagram and every
+ * datagram from the peer comes back down as a frame. The socket is connected
+ * so only that peer is listened to. ng_ksocket goes away by itself when its
+ * hook is removed, so destroy_bridge() needs nothing special for it.
+ *
+ * The socket is made and set up behind a tee on our socket
+ *
+ *	bridge:uplinkX <-> left [tee] right <-> ksocket
+ *	                   left2right
+ *	                        ^
+ *	                       .:tun
+ *
+ * the tee's left goes on a bare "uplink" so ng_bridge picks the number, and
+ * shutting the tee down joins the bridge straight to the socket. Two tunnels
+ * made at once can't both go for the same uplink that way.
+ *
+ * Frames can't be batched into datagrams without something at the other end
+ * to split them again, so instead the socket buffers are made big enough to
+ * ride out a burst. A full size frame plus the UDP and IP headers is more
+ * than a 1500 byte path MTU, the IP stack on each end fragments and
+ * reassembles that for us.
+ */
+#define	TUN_SOCKBUF	(1024 * 1024)
+
+static int
+connect_tunnel(int ngs, const char *bridge, const struct sockaddr *local,
+    const struct sockaddr *peer, char *hook, size_t len)
+{
+	int				idx, err;
+	struct ng_mesg			*resp;
+	struct hooklist			*hlist;
+	struct ngm_mkpeer		tp = {
+		.type = "tee",
+		.ourhook = "tun",
+		.peerhook = "left2right"
+	};
+	struct ngm_mkpeer		mp = {
+		.type = "ksocket",
+		.ourhook = "right"
+	};
+	struct ngm_connect		cn = {
+		.ourhook = "left",
+		.peerhook = "uplink"
+	};
+	union {
+		struct ng_ksocket_sockopt	opt;
+		u_char	buf[sizeof(struct ng_ksocket_sockopt) + sizeof(int)];
+	}				so;
+	static const int		bufopt[] = { SO_SNDBUF, SO_RCVBUF };
+	static const int		bufsiz = TUN_SOCKBUF;
+
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &tp, sizeof(tp)))
+		return (-1);
+	(void) strlcpy(mp.peerhook,
+	    (AF_INET6 == local->sa_family) ? "inet6/dgram/udp" : "inet/dgram/udp",
+	    sizeof(mp.peerhook)
+	);
+	if (-1 == NgSendMsg(ngs, ".:tun", NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
+		goto fail;
+
+	so.opt.level = SOL_SOCKET;
+	bcopy(&bufsiz, so.opt.value, sizeof(bufsiz));
+	for (idx = 0; idx < 2; idx++) {
+		so.opt.name = bufopt[idx];
+		(void) NgSendMsg(ngs, ".:tun.right", NGM_KSOCKET_COOKIE,
+		    NGM_KSOCKET_SETOPT, &so, sizeof(so));
+	}
+
+	if (-1 == NgSendMsg(ngs, ".:tun.right", NGM_KSOCKET_COOKIE,
+	    NGM_KSOCKET_BIND, local, local->sa_len))
+		goto fail;
+	if (-1 == NgSendMsg(ngs, ".:tun.right", NGM_KSOCKET_COOKIE,
+	    NGM_KSOCKET_CONNECT, peer, peer->sa_len))
+		goto fail;
+
+	/* on the bridge, and the uplink it got is the tee's left peerhook */
+	(void) strlcpy(cn.path, bridge, sizeof(cn.path));
+	if (-1 == NgSendMsg(ngs, ".:tun", NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto fail;
+	if (-1 == ng_list_hooks(ngs, ".:tun", &resp))
+		goto fail;
+	hlist = (struct hooklist *) resp->data;
+	for (idx = 0; idx < hlist->nodeinfo.hooks; idx++)
+		if (0 == strcmp(hlist->link[idx].ourhook, "left"))
+			(void) strlcpy(hook, hlist->link[idx].peerhook, len);
+	free(resp);
+
+	if (-1 == NgSendMsg(ngs, ".:tun", NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0))
+		goto fail;
+	return (0);
+
+fail:
+	/* the socket first, so the tee can't join it to the bridge as it goes */
+	err = errno;
+	(void) NgSendMsg(ngs, ".:tun.right", NGM_GENERIC_COOKIE,
+	    NGM_SHUTDOWN, NULL, 0);
+	(void) NgSendMsg(ngs, ".:tun", NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	errno = err;
+	return (-1);
+}
+
+
+/*
+ * Storm control sits between the ether's lower hook and the bridge's uplink1
+ *
+ *	ether:lower <-> ether [bpf] bridge <-> bridge:uplink1
+ *	                       storm | ^ policed
+ *	                       upper v | lower
+ *	                           [car]
+ *
+ * Frames from the wire with the group bit set in the destination (broadcast
+ * and multicast) go the long way round through the car, everything else goes
+ * straight to the bridge. Nothing from the bridge to the wire is touched. The
+ * car counts packets rather than bits so the limit is in frames per second.
+ */
+static const struct bpf_insn storm_group[] = {
+	BPF_STMT(BPF_LD + BPF_B + BPF_ABS, 0),
+	BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, 0x01, 0, 1),
+	BPF_STMT(BPF_RET + BPF_K, (u_int) -1),
+	BPF_STMT(BPF_RET + BPF_K, 0)
+};
+
+static const struct bpf_insn storm_all[] = {
+	BPF_STMT(BPF_RET + BPF_K, (u_int) -1)
+};
+
+/*
+ * In packet mode ng_car takes the rate in packets per second and the burst
+ * in packets, it scales them itself. The burst is a second's worth, so a
+ * short spike gets through but a storm is held to pps. The other direction
+ * never carries anything but it still has to be valid.
+ */
+static int
+storm_conf(int ngs, const char *car, u_int pps)
+{
+	struct ng_car_bulkconf	bc;
+
+	bzero(&bc, sizeof(bc));
+	bc.downstream.cir = pps;
+	bc.downstream.cbs = pps;
+	bc.downstream.ebs = 0;
+	bc.downstream.green_action = NG_CAR_ACTION_FORWARD;
+	bc.downstream.yellow_action = NG_CAR_ACTION_DROP;
+	bc.downstream.red_action = NG_CAR_ACTION_DROP;
+	bc.downstream.mode = NG_CAR_SINGLE_RATE;
+	bc.downstream.opt = NG_CAR_COUNT_PACKETS;
+
+	bc.upstream = bc.downstream;
+	bc.upstream.yellow_action = NG_CAR_ACTION_FORWARD;
+	bc.upstream.red_action = NG_CAR_ACTION_FORWARD;
+
+	if (-1 == NgSendMsg(ngs, car, NGM_CAR_COOKIE, NGM_CAR_SET_CONF,
+	    &bc, sizeof(bc)))
+		return (-1);
+	return (0);
+}
+
+
+/*
+ * Everything is put together hanging off our socket first, so the bridge only
+ * notices the two hooks at the end being moved. Between those a few frames
+ * from the wire may be lost.
+ */
+static int
+storm_insert(int ngs, const char *bridge, const char *ether,
+    const char *etherhook, u_int pps)
+{
+	int			err;
+	char			bpf[NG_PATHSIZ], car[NG_PATHSIZ];
+	struct ng_mesg		*resp;
+	struct ngm_rmhook	rm = {
+		.ourhook = "sc"
+	};
+	struct ngm_mkpeer	bp = {
+		.type = "bpf",
+		.ourhook = "sc",
+		.peerhook = "bridge"
+	};
+	struct ngm_mkpeer	mp = {
+		.type = "car",
+		.ourhook = "storm",
+		.peerhook = "upper"
+	};
+	struct ngm_connect	cn = {
+		.path = "storm",
+		.ourhook = "policed",
+		.peerhook = "lower"
+	};
+
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &bp, sizeof(bp)))
+		return (-1);
+	if (-1 == ng_ask(ngs, ".:sc", NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0,
+	    &resp)) {
+		err = errno;
+		(void) NgSendMsg(ngs, ".:sc", NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+		errno = err;
+		return (-1);
+	}
+	(void) snprintf(bpf, sizeof(bpf), "[%x]:",
+	    ((struct nodeinfo *) resp->data)->id
+	);
+	(void) snprintf(car, sizeof(car), "[%x]:storm",
+	    ((struct nodeinfo *) resp->data)->id
+	);
+	free(resp);
+
+	if (-1 == NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
+		goto fail;
+	if (-1 == NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto fail;
+	if (-1 == storm_conf(ngs, car, pps))
+		goto fail;
+	if (-1 == set_bpf_prog(ngs, bpf, "policed", "bridge", "", storm_all, 1))
+		goto fail;
+	if (-1 == set_bpf_prog(ngs, bpf, "bridge", "ether", "", storm_all, 1))
+		goto fail;
+	/* the car keeps the bpf alive */
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm)))
+		goto fail;
+
+	/* now the bridge can notice */
+	(void) strlcpy(rm.ourhook, "uplink1", sizeof(rm.ourhook));
+	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm)))
+		goto fail;
+	(void) strlcpy(cn.path, bpf, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, "uplink1", sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "bridge", sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+	(void) strlcpy(cn.ourhook, etherhook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "ether", sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, ether, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+	if (-1 == set_bpf_prog(ngs, bpf, "ether", "storm", "bridge",
+	    storm_group, sizeof(storm_group) / sizeof(*storm_group)))
+		goto restore;
+	return (0);
+
+restore:
+	/* straight back to the way connect_ether() left it */
+	err = errno;
+	(void) NgSendMsg(ngs, car, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	(void) NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	(void) strlcpy(cn.path, ether, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, "uplink1", sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, etherhook, sizeof(cn.peerhook));
+	(void) NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn));
+	errno = err;
+	return (-1);
+
+fail:
+	err = errno;
+	(void) NgSendMsg(ngs, car, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	(void) NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	errno = err;
+	return (-1);
+}
+
+
+/* undo storm_insert(), bpf is the ID path of the one on uplink1 */
+static int
+storm_remove(int ngs, const char *bridge, const char *bpf)
+{
+	char			ether[NG_PATHSIZ], etherhook[NG_HOOKSIZ];
+	char			type[NG_TYPESIZ], path[NG_PATHSIZ];
+	struct ngm_connect	cn = {
+		.ourhook = "uplink1"
+	};
+
+	if (-1 == hook_peer(ngs, bpf, "ether", ether, sizeof(ether),
+	    etherhook, type))
+		return (-1);
+	(void) snprintf(path, sizeof(path), "%sstorm", bpf);
+	if (-1 == NgSendMsg(ngs, path, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0))
+		return (-1);
+	if (-1 == NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0))
+		return (-1);
+	(void) strlcpy(cn.path, ether, sizeof(cn.path));
+	(void) strlcpy(cn.peerhook, etherhook, sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		return (-1);
+	return (0);
+}
+
+
+/*
+ * pps 0 takes storm control off again, otherwise it is put on or if it is
+ * already there just gets the new limit. Only a physical bridge has an ether
+ * on uplink1 to protect.
+ */
+static int
+storm_set(int ngs, const char *bridge, u_int pps)
+{
+	char	peer[NG_PATHSIZ], peerhook[NG_HOOKSIZ], type[NG_TYPESIZ];
+	char	path[NG_PATHSIZ];
+
+	if (-1 == hook_peer(ngs, bridge, "uplink1", peer, sizeof(peer),
+	    peerhook, type))
+		return (-1);
+	if (0 == strcmp(type, "bpf")) {
+		if (0 == pps)
+			return (storm_remove(ngs, bridge, peer));
+		(void) snprintf(path, sizeof(path), "%sstorm", peer);
+		return (storm_conf(ngs, path, pps));
+	}
+	if (0 != strcmp(type, "ether")) {
+		errno = ENOENT;
+		return (-1);
+	}
+	if (0 == pps)
+		return (0);
+	return (storm_insert(ngs, bridge, peer, peerhook, pps));
+}
+
+
+static int
+storm_stats(int ngs, const char *bridge, struct ngvj_storm *st)
+{
+	char				peer[NG_PATHSIZ], path[NG_PATHSIZ];
+	char				peerhook[NG_HOOKSIZ], type[NG_TYPESIZ];
+	struct ng_mesg			*resp;
+	struct ng_car_bulkconf		*bc;
+	struct ng_car_bulkstats		*bs;
+
+	if (-1 == hook_peer(ngs, bridge, "uplink1", peer, sizeof(peer),
+	    peerhook, type))
+		return (-1);
+	if (0 != strcmp(type, "bpf")) {
+		errno = ENOENT;
+		return (-1);
+	}
+	(void) snprintf(path, sizeof(path), "%sstorm", peer);
+
+	if (-1 == ng_ask(ngs, path, NGM_CAR_COOKIE, NGM_CAR_GET_CONF, NULL, 0,
+	    &resp))
+		return (-1);
+	bc = (struct ng_car_bulkconf *) resp->data;
+	st->pps = bc->downstream.cir;
+	free(resp);
+
+	if (-1 == ng_ask(ngs, path, NGM_CAR_COOKIE, NGM_CAR_GET_STATS, NULL, 0,
+	    &resp))
+		return (-1);
+	bs = (struct ng_car_bulkstats *) resp->data;
+	st->passed = bs->downstream.passed_pkts;
+	st->dropped = bs->downstream.dropped_pkts;
+	free(resp);
+	return (0);
+}
+
+
+/* ENTRY POINTS */
+
+int
+ngvj_bridge_create(struct ngvj_ctx *ctx, const char *name)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "nonexistent")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "create bridge");
+	if (-1 == create_bridge(ctx->csock, bridge))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/* NGVJ_OK if ether is free for a bridge, NGVJ_EBUSY if it is on one */
+int
+ngvj_ether_busy(struct ngvj_ctx *ctx, const char *name)
+{
+	int	rc;
+	char	ether[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "ether")))
+		return (rc);
+	(void) ngvj_path(ether, sizeof(ether), name);
+
+	ngvj_begin(ctx, "list ether hooks");
+	if (-1 == (rc = ether_is_connected(ctx->csock, ether)))
+		return (ngvj_error(ctx));
+	return ((0 == rc) ? NGVJ_OK : NGVJ_EBUSY);
+}
+
+
+/* only on a bridge fresh from ngvj_bridge_create(), it needs link0 free */
+int
+ngvj_bridge_attach(struct ngvj_ctx *ctx, const char *name, const char *ename)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ], ether[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	if (NGVJ_OK != (rc = ngvj_ether_busy(ctx, ename)))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+	(void) ngvj_path(ether, sizeof(ether), ename);
+
+	ngvj_begin(ctx, "promiscuous mode");
+	if (-1 == connect_ether(ctx->csock, bridge, ether))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/* after ngvj_bridge_attach() if there is an ether, so it keeps link0 */
+int
+ngvj_bridge_shard(struct ngvj_ctx *ctx, const char *name, int shards)
+{
+	int	rc, shard;
+	char	bridge[NG_PATHSIZ], path[NG_PATHSIZ];
+
+	if (shards < 1 || shards > NGVJ_SHARD_MAX)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	for (shard = 1; shard < shards; shard++) {
+		(void) ngvj_shard_name(path, sizeof(path), name, shard);
+		if (NGVJ_OK != (rc = ngvj_check(ctx, path, "nonexistent")))
+			return (rc);
+	}
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "create shard");
+	if (-1 == create_shards(ctx->csock, bridge, shards))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/* every shard goes, anything still connected is just disconnected */
+int
+ngvj_bridge_destroy(struct ngvj_ctx *ctx, const char *name)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "destroy bridge");
+	if (-1 == destroy_shards(ctx->csock, bridge))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+int
+ngvj_bridge_list(struct ngvj_ctx *ctx, const char *name, ngvj_link_cb cb,
+    void *arg)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (NULL == cb)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "list bridge hooks");
+	if (-1 == list_bridge(ctx->csock, bridge, cb, arg))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/* hook gets the uplinkX the tunnel is on, NG_HOOKSIZ is plenty */
+int
+ngvj_bridge_tunnel(struct ngvj_ctx *ctx, const char *name,
+    const struct sockaddr *local, const struct sockaddr *peer,
+    char *hook, size_t len)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (NULL == local || NULL == peer || local->sa_family != peer->sa_family)
+		return (NGVJ_EINVAL);
+	if (AF_INET != local->sa_family && AF_INET6 != local->sa_family)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "tunnel");
+	if (-1 == connect_tunnel(ctx->csock, bridge, local, peer, hook, len))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/*
+ * The tap hangs off the context's own socket node, so it needs NGVJ_DATA and
+ * a context only has room for one. filter is NULL for everything.
+ */
+int
+ngvj_tap_insert(struct ngvj_ctx *ctx, const char *name, const char *hook,
+    const struct bpf_program *filter)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (-1 == ctx->dsock || NULL == hook || '\0' == *hook ||
+	    strlen(hook) >= NG_HOOKSIZ)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "tap");
+	if (-1 == tap_insert(ctx->csock, bridge, hook, filter))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/* works from any context, not just the one that made the tap */
+int
+ngvj_tap_remove(struct ngvj_ctx *ctx, const char *name, const char *hook)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (NULL == hook || '\0' == *hook || strlen(hook) >= NG_HOOKSIZ)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "untap");
+	if (-1 == tap_remove(ctx->csock, bridge, hook))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/*
+ * One tapped frame, in either direction, into buf. Blocks unless dsock was
+ * polled first. -1 with errno set on failure, like recv(2).
+ */
+ssize_t
+ngvj_tap_recv(struct ngvj_ctx *ctx, void *buf, size_t len)
+{
+	char	hook[NG_HOOKSIZ];
+
+	if (-1 == ctx->dsock) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (NgRecvData(ctx->dsock, buf, len, hook));
+}
+
+
+/* pps limits broadcast and multicast from the wire, 0 takes it off */
+int
+ngvj_storm_set(struct ngvj_ctx *ctx, const char *name, u_int pps)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (pps > NGVJ_STORM_MAX)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "storm control");
+	if (-1 == storm_set(ctx->csock, bridge, pps))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/* NGVJ_ENOENT if the bridge has no storm control */
+int
+ngvj_storm_stats(struct ngvj_ctx *ctx, const char *name, struct ngvj_storm *st)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), name);
+
+	ngvj_begin(ctx, "storm stats");
+	if (-1 == storm_stats(ctx->csock, bridge, st))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
@@ -0,0 +1,863 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netgraph/ng_bridge.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <net/if_dl.h>
+#include <net/route.h>
+
+#define	LLNAMSIZ	18
+
+/*
+ * Announcing is shared by everybody on the host through ANNOUNCE_LOCK, which
+ * holds when the next frame may go. Each frame takes the next free slot, so
+ * a few hundred jails starting together take turns at ANNOUNCE_PPS instead
+ * of all hitting the wire at once. Rounds for one eiface are ANNOUNCE_GAP
+ * apart, like the repeats of RFC 5227 and RFC 4861.
+ *
+ * The slot is CLOCK_MONOTONIC, which every process on the host shares and
+ * which starts again at boot. /var/run is emptied at boot so the file
+ * shouldn't outlive it, but a slot more than ANNOUNCE_AHEAD away can only
+ * be from an earlier boot and is ignored rather than waited for.
+ *
+ * The frames go out through netgraph, which is only on the host, so the
+ * lock is host wide whichever vnet the interfaces are in. The tests point
+ * it somewhere they can write.
+ */
+#ifndef	ANNOUNCE_LOCK
+#define	ANNOUNCE_LOCK	"/var/run/ngvjail.announce"
+#endif
+#define	ANNOUNCE_PPS	100
+#define	ANNOUNCE_GAP	1000	/* ms */
+#define	ANNOUNCE_AHEAD	600	/* seconds */
+#define	ANNOUNCE_ADDRS	16
+
+/* FUNCTIONS */
+
+/* a proxy for the bridge has its socket named after shard 0 */
+static int
+proxy_running(int ngs, const char *bridge)
+{
+	const char	*type;
+	char		path[NG_PATHSIZ];
+
+	(void) snprintf(path, sizeof(path), "%.*s-proxy:",
+	    (int)(strlen(bridge) - 1), bridge
+	);
+	type = ng_type(ngs, path);
+	return (NULL != type && 0 != strcmp(type, "nonexistent"));
+}
+
+/*
+ * We just use "link" which will give us the lowest hook. With the proxy
+ * running the link gets the proxy's bpf straight away
+ *
+ *	bridge:linkN <-> b [bpf] j <-> eiface:ether
+ *
+ * passing everything both ways until the proxy adopts it on its next rescan.
+ * If the proxy spliced it in itself the jail would see its link go down and
+ * up again, after `ng-eiface -w` said it was up.
+ */
+static int
+connect_eiface(struct ngvj_ctx *ctx, const char *bridge, const char *eiface,
+    int proxied)
+{
+	const int ngs = ctx->csock;
+	int err;
+	char bpf[NG_PATHSIZ];
+	const struct bpf_insn pass = BPF_STMT(BPF_RET + BPF_K, (u_int) -1);
+	struct ngm_mkpeer mp = {
+		.type = "bpf",
+		.ourhook = "ether",
+		.peerhook = "j"
+	};
+	struct ngm_connect cn = {
+		/* .path = eiface, */
+		.ourhook = "link",
+		.peerhook = "ether",
+	};
+
+	ctx->step = "connection";
+	(void) strlcpy(cn.path, eiface, sizeof(cn.path));
+	if (proxied) {
+		ctx->step = "proxy bpf";
+		if (-1 == NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
+			return (-1);
+		(void) snprintf(bpf, sizeof(bpf), "%sether", eiface);
+		(void) strlcpy(cn.path, bpf, sizeof(cn.path));
+		(void) strlcpy(cn.peerhook, "b", sizeof(cn.peerhook));
+	}
+	if (-1 == NgSendMsg(ngs, bridge, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto fail;
+	if (proxied && (-1 == set_bpf_prog(ngs, bpf, "j", "b", "", &pass, 1) ||
+	    -1 == set_bpf_prog(ngs, bpf, "b", "j", "", &pass, 1)))
+		goto fail;
+	return (0);
+
+fail:
+	/* the bpf takes the bridge hook with it */
+	err = errno;
+	if (proxied)
+		(void) NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	errno = err;
+	return (-1);
+}
+
+/* whatever ether is connected to, our socket or a bridge */
+static int
+disconnect_eiface(struct ngvj_ctx *ctx, const char *eiface)
+{
+	const int ngs = ctx->csock;
+	struct ngm_rmhook rm = {
+		.ourhook = "ether"
+	};
+
+	ctx->step = "un-hook";
+	if (-1 == NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm)))
+		return (-1);
+	return (0);
+}
+
+static int
+create_eiface(struct ngvj_ctx *ctx, const char *bridge, const char *eiface,
+    int proxied)
+{
+	const int ngs = ctx->csock;
+	int rc, skt;
+	struct ngm_name nm;
+	struct ngm_mkpeer mp = {
+		.type = "eiface",
+		.ourhook = "lower", /* was "linkN", */
+		.peerhook = "ether"
+	};
+	struct ng_mesg	*resp;
+	struct nodeinfo *ninfo;
+	struct ifreq	ifr;
+
+	/* create it connected to our ngs, this lets us find it */
+	ctx->step = "mkpeer";
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
+		return (-1);
+
+	/* but we do need to know what name it got to change the interface name for ifconfig */
+	ctx->step = "nodeinfo";
+        rc = NgSendMsg(ngs, ".:lower", NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0);
+        if (-1 == rc)
+		return (-1);
+
+	ctx->step = "nodeinfo:recvmsg";
+        rc = ng_recv_reply(ngs, rc, &resp);
+        if (-1 == rc)
+		return (-1);
+	ninfo = (struct nodeinfo *) resp->data;
+	(void) strlcpy(nm.name, eiface, sizeof(nm.name));
+	*(nm.name + strlen(nm.name) - 1) = '\0'; /* remove ':' */
+
+	strncpy(ifr.ifr_name, ninfo->name, sizeof(ifr.ifr_name));
+	ifr.ifr_data = nm.name;
+	free(resp);
+
+	ctx->step = "rename";
+	if (-1 == NgSendMsg(ngs, ".:lower", NGM_GENERIC_COOKIE, NGM_NAME, &nm, sizeof(nm)))
+		return (-1);
+
+	if (-1 == disconnect_eiface(ctx, eiface))
+		return (-1);
+
+	if (-1 == connect_eiface(ctx, bridge, eiface, proxied))
+		return (-1);
+
+	// rename interface too
+	ctx->step = "socket";
+	if (-1 == (skt = socket(AF_LOCAL, SOCK_DGRAM, 0)))
+		return (-1);
+	ctx->step = "ioctl";
+	if (-1 == ioctl(skt, SIOCSIFNAME, &ifr)) {
+		rc = errno;
+		(void) close(skt);
+		errno = rc;
+		return (-1);
+	}
+
+        (void) close(skt);
+
+	return (0); 
+}
+
+static int
+destroy_eiface(int ngs, const char *eiface)
+{
+	int		rc, idx;
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct nodeinfo	*ninfo;
+
+	rc = ng_list_hooks(ngs, eiface, &resp);
+	if (-1 == rc) return (-1);
+
+	hlist = (struct hooklist *) resp->data;
+	ninfo = &hlist->nodeinfo;
+
+	/* all interfaces can be removed, there is one or zero ... */
+	for (idx = 0; idx < ninfo->hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+		char path[NG_PATHSIZ];
+
+		/*
+		 * The proxy's bpf goes too, with the one2many on its "q" if
+		 * the proxy got that far. There may be no proxy left to take
+		 * it off the bridge.
+		 */
+		if (0 == strcmp(link->nodeinfo.type, "bpf") &&
+		    0 == strcmp(link->peerhook, "j")) {
+			(void) snprintf(path, sizeof(path), "[%x]:q",
+			    link->nodeinfo.id
+			);
+			rc = NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+			    NGM_SHUTDOWN, NULL, 0);
+			(void) snprintf(path, sizeof(path), "[%x]:",
+			    link->nodeinfo.id
+			);
+			rc = NgSendMsg(ngs, path, NGM_GENERIC_COOKIE,
+			    NGM_SHUTDOWN, NULL, 0);
+			continue;
+		}
+		rc = NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE,
+		    NGM_RMHOOK, link, sizeof(struct ngm_rmhook));
+	}
+
+	rc = NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+
+	return (0);
+}
+
+/*
+ * Only the ether hook moves. The ifnet keeps its name, MAC, vnet and
+ * addresses, the jail just loses whatever frames were in flight.
+ */
+static int
+move_eiface(struct ngvj_ctx *ctx, const char *bridge, const char *eiface,
+    int proxied)
+{
+	const int	ngs = ctx->csock;
+	int		idx, pass, tapped;
+	char		old[NG_PATHSIZ];
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct nodeinfo	*ninfo;
+	struct ngm_connect cn = {
+		.peerhook = "ether"
+	};
+
+	/* remember where it was so a failed move can put it back */
+	*old = '\0';
+	for (pass = 0; pass < 2; pass++) {
+		tapped = 0;
+		if (-1 == ng_list_hooks(ngs, eiface, &resp)) return (-1);
+
+		hlist = (struct hooklist *) resp->data;
+		ninfo = &hlist->nodeinfo;
+		for (idx = 0; idx < ninfo->hooks; idx++) {
+			struct linkinfo *const link = &hlist->link[idx];
+
+			if (0 != strcmp(link->ourhook, "ether")) continue;
+			(void) snprintf(old, sizeof(old), "[%x]:",
+			    link->nodeinfo.id
+			);
+			(void) strlcpy(cn.ourhook, link->peerhook,
+			    sizeof(cn.ourhook)
+			);
+			/* an `ng-bridge -t` tap, take it out and look again */
+			if (0 == strcmp(link->nodeinfo.type, "tee")) {
+				(void) NgSendMsg(ngs, old, NGM_GENERIC_COOKIE,
+				    NGM_SHUTDOWN, NULL, 0);
+				*old = '\0';
+				tapped = 1;
+			}
+		}
+		free(resp);
+		if (!tapped) break;
+	}
+
+	/* not on any bridge is fine, there is just nothing to undo */
+	if ('\0' != *old && -1 == disconnect_eiface(ctx, eiface))
+		return (-1);
+
+	if (-1 == connect_eiface(ctx, bridge, eiface, proxied)) {
+		if ('\0' != *old) {
+			idx = errno;
+			(void) strlcpy(cn.path, eiface, sizeof(cn.path));
+			(void) NgSendMsg(ngs, old, NGM_GENERIC_COOKIE,
+			    NGM_CONNECT, &cn, sizeof(cn));
+			errno = idx;
+		}
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+set_mac(const char *name, const char *mac)
+{
+	int			skt;
+	struct sockaddr_dl	sdl;
+	struct ifreq		ifr;
+	struct sockaddr		*sa;
+	char			temp[LLNAMSIZ + 1];
+
+	sa = &ifr.ifr_addr;
+
+	temp[0] = ':';
+	strcpy(temp + 1, mac);
+	sdl.sdl_len = sizeof(sdl);
+	link_addr(temp, &sdl);
+	if (sdl.sdl_alen > sizeof(sa->sa_data)) {
+		errno = EINVAL;  /* malformed mac */
+		return (-1);
+	}
+	sa->sa_family = AF_LINK;
+	sa->sa_len = sdl.sdl_alen;
+	bcopy(LLADDR(&sdl), sa->sa_data, sdl.sdl_alen);
+
+	if (-1 == (skt = socket(AF_LOCAL, SOCK_DGRAM, 0)))
+		return (-1);
+	/*
+	 * Unfortunately this is one time we don't want ':' on the end of the name.
+	 * But for sake of consistent args to functions we will remove it rather than
+	 * pass in a different string here.
+	 */
+	strncpy(temp, name, sizeof(temp));
+	*(temp + strlen(temp) - 1) = '\0'; /* remove ':' */
+	strncpy(ifr.ifr_name, temp, sizeof(ifr.ifr_name));
+
+	if (-1 == ioctl(skt, SIOCSIFLLADDR, &ifr)) {
+		(void) close(skt);
+		return (-1);
+	}
+
+	(void) close(skt);
+	return (0);
+}
+
+/*
+ * Ready means the ifnet answers to its new name, has our mac address and
+ * reports link up (ng_eiface does as soon as ether is connected). Asking for
+ * just the one interface keeps this cheap with hundreds of jails around.
+ */
+static int
+eiface_ready(const char *name, const u_char *lladdr)
+{
+	int			ready;
+	int			mib[] = {
+		CTL_NET, PF_ROUTE, 0, AF_LINK, NET_RT_IFLIST, 0
+	};
+	size_t			len;
+	char			*buf;
+	struct if_msghdr	*ifm;
+	struct sockaddr_dl	*sdl;
+
+	if (0 == (mib[5] = if_nametoindex(name)))
+		return (0); /* not renamed yet */
+	if (-1 == sysctl(mib, 6, NULL, &len, NULL, 0))
+		return ((ENOENT == errno) ? 0 : -1);
+	if (NULL == (buf = malloc(len)))
+		return (-1);
+	if (-1 == sysctl(mib, 6, buf, &len, NULL, 0)) {
+		free(buf);
+		return ((ENOENT == errno) ? 0 : -1);
+	}
+
+	ready = 0;
+	ifm = (struct if_msghdr *) buf;
+	if (RTM_IFINFO == ifm->ifm_type && (ifm->ifm_addrs & RTA_IFP)) {
+		sdl = (struct sockaddr_dl *) (ifm + 1);
+		ready = (LINK_STATE_UP == ifm->ifm_data.ifi_link_state &&
+		    ETHER_ADDR_LEN == sdl->sdl_alen &&
+		    0 == bcmp(LLADDR(sdl), lladdr, ETHER_ADDR_LEN));
+	}
+	free(buf);
+	return (ready);
+}
+
+/*
+ * Rather than sleeping, recheck only when the kernel says something about
+ * our interface: an RTM_IFANNOUNCE for the new name or an RTM_IFINFO for its
+ * index. So this waits exactly as long as the kernel needs, up to timeout.
+ * eiface has the ':' on the end like everywhere else.
+ */
+static int
+wait_eiface(int rskt, const char *eiface, const char *mac, int timeout)
+{
+	int			rc, left, ours;
+	u_int			idx;
+	ssize_t			len;
+	u_char			lladdr[ETHER_ADDR_LEN];
+	char			name[IFNAMSIZ];
+	char			buf[2048];
+	struct ether_addr	*ea;
+	struct timespec		start, now;
+	struct pollfd		pfd = {
+		.fd = rskt,
+		.events = POLLIN
+	};
+
+	(void) strlcpy(name, eiface, sizeof(name));
+	*(name + strlen(name) - 1) = '\0'; /* remove ':' */
+	if (NULL == (ea = ether_aton(mac))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	bcopy(ea, lladdr, sizeof(lladdr));
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+	ours = 1; /* it may well be ready already */
+	for (;;) {
+		if (ours && 0 != (rc = eiface_ready(name, lladdr)))
+			return ((1 == rc) ? 0 : -1);
+
+		(void) clock_gettime(CLOCK_MONOTONIC, &now);
+		left = timeout * 1000 - (int) ((now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return (-1);
+		}
+
+		/* sleep until anything happens, then see if it was for us */
+		idx = if_nametoindex(name);
+		rc = poll(&pfd, 1, left);
+		if (-1 == rc && EINTR != errno) return (-1);
+		if (1 != rc) {
+			ours = 1; /* one last look before giving up */
+			continue;
+		}
+		ours = 0;
+		while (0 < (len = recv(rskt, buf, sizeof(buf), MSG_DONTWAIT))) {
+			struct if_msghdr *ifm = (struct if_msghdr *) buf;
+			struct if_announcemsghdr *ifan =
+			    (struct if_announcemsghdr *) buf;
+
+			if (RTM_IFINFO == ifm->ifm_type &&
+			    (0 == idx || ifm->ifm_index == idx))
+				ours = 1;
+			if (RTM_IFANNOUNCE == ifan->ifan_type &&
+			    0 == strcmp(ifan->ifan_name, name))
+				ours = 1;
+		}
+	}
+}
+
+static int64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+sleep_until(int64_t when)
+{
+	int64_t		left;
+	struct timespec	ts;
+
+	while ((left = when - now_ns()) > 0) {
+		ts.tv_sec = left / 1000000000;
+		ts.tv_nsec = left % 1000000000;
+		(void) nanosleep(&ts, NULL);
+	}
+}
+
+/* take the next host wide slot and wait for it */
+static int
+announce_slot(int lock)
+{
+	int		err;
+	int64_t		now, slot, next;
+
+	if (-1 == flock(lock, LOCK_EX)) return (-1);
+	now = now_ns();
+	if (sizeof(slot) != pread(lock, &slot, sizeof(slot), 0) || slot < now ||
+	    slot > now + ANNOUNCE_AHEAD * 1000000000LL)
+		slot = now;
+	next = slot + 1000000000 / ANNOUNCE_PPS;
+	if (-1 == pwrite(lock, &next, sizeof(next), 0)) {
+		err = errno;
+		(void) flock(lock, LOCK_UN);
+		errno = err;
+		return (-1);
+	}
+	(void) flock(lock, LOCK_UN);
+	sleep_until(slot);
+	return (0);
+}
+
+/*
+ * The frames go into the eiface's own link from our socket, as if the jail
+ * had sent them, so the bridge learns the mac address on the right link and
+ * floods them to the wire for the switch. Being netgraph that works with the
+ * interface down and whichever vnet it is in. Behind the proxy they get a
+ * hook of their own on its bpf, which sends them to the bridge
+ *
+ *	bridge:linkN <-> b [bpf] j <-> eiface:ether
+ *	                announce
+ *	                    ^
+ *	                .:announce
+ *
+ * so the jail's link is left alone. Otherwise a tee is spliced in for as long
+ * as it takes, and shutting it down joins the link up again.
+ *
+ *	bridge:linkN <-> left [tee] right <-> eiface:ether
+ *	                     right2left
+ *	                         ^
+ *	                     .:announce
+ */
+static int
+announce_link(int ngs, const char *eiface, int *spliced)
+{
+	int			idx, proxied, err;
+	char			peer[NG_PATHSIZ], peerhook[NG_HOOKSIZ];
+	const struct bpf_insn	pass = BPF_STMT(BPF_RET + BPF_K, (u_int) -1);
+	struct ng_mesg		*resp;
+	struct hooklist		*hlist;
+	struct ngm_rmhook	rm;
+	struct ngm_connect	cn;
+	struct ngm_mkpeer	mp = {
+		.type = "tee",
+		.ourhook = "announce",
+		.peerhook = "right2left"
+	};
+
+	if (-1 == ng_list_hooks(ngs, eiface, &resp)) return (-1);
+	hlist = (struct hooklist *) resp->data;
+	*peer = '\0';
+	proxied = 0;
+	for (idx = 0; idx < hlist->nodeinfo.hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+
+		if (0 != strcmp(link->ourhook, "ether")) continue;
+		(void) snprintf(peer, sizeof(peer), "[%x]:", link->nodeinfo.id);
+		(void) strlcpy(peerhook, link->peerhook, sizeof(peerhook));
+		proxied = (0 == strcmp(link->nodeinfo.type, "bpf") &&
+		    0 == strcmp(link->peerhook, "j"));
+	}
+	free(resp);
+	if ('\0' == *peer) {
+		errno = ENOTCONN; /* on no bridge, nobody to tell */
+		return (-1);
+	}
+
+	*spliced = !proxied;
+	if (proxied) {
+		(void) strlcpy(cn.path, peer, sizeof(cn.path));
+		(void) strlcpy(cn.ourhook, "announce", sizeof(cn.ourhook));
+		(void) strlcpy(cn.peerhook, "announce", sizeof(cn.peerhook));
+		if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+			return (-1);
+		if (-1 == set_bpf_prog(ngs, peer, "announce", "b", "b", &pass, 1)) {
+			err = errno;
+			(void) strlcpy(rm.ourhook, "announce", sizeof(rm.ourhook));
+			(void) NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE,
+			    NGM_RMHOOK, &rm, sizeof(rm));
+			errno = err;
+			return (-1);
+		}
+		return (0);
+	}
+
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
+		return (-1);
+	(void) strlcpy(rm.ourhook, peerhook, sizeof(rm.ourhook));
+	if (-1 == NgSendMsg(ngs, peer, NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm))) {
+		err = errno;
+		(void) NgSendMsg(ngs, ".:announce", NGM_GENERIC_COOKIE,
+		    NGM_SHUTDOWN, NULL, 0);
+		errno = err;
+		return (-1);
+	}
+	(void) strlcpy(cn.path, peer, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, "left", sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, peerhook, sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, ".:announce", NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+	(void) strlcpy(cn.path, eiface, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, "right", sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "ether", sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, ".:announce", NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+	return (0);
+
+restore:
+	/* the tee has no right hook, so it can't join anything as it goes */
+	err = errno;
+	(void) NgSendMsg(ngs, ".:announce", NGM_GENERIC_COOKIE,
+	    NGM_SHUTDOWN, NULL, 0);
+	(void) strlcpy(cn.path, eiface, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, peerhook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "ether", sizeof(cn.peerhook));
+	(void) NgSendMsg(ngs, peer, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn));
+	errno = err;
+	return (-1);
+}
+
+/* the tee's shutdown puts the link back, the bpf just loses a hook */
+static void
+announce_unlink(int ngs, int spliced)
+{
+	struct ngm_rmhook	rm = {
+		.ourhook = "announce"
+	};
+
+	if (spliced)
+		(void) NgSendMsg(ngs, ".:announce", NGM_GENERIC_COOKIE,
+		    NGM_SHUTDOWN, NULL, 0);
+	else
+		(void) NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE,
+		    NGM_RMHOOK, &rm, sizeof(rm));
+}
+
+static int
+announce(int ngs, int dsock, const char *eiface, const char *mac,
+    int family[], u_char addr[][16], int naddr, int count)
+{
+	int			lock, spliced, round, idx, len, err;
+	u_char			lladdr[ETHER_ADDR_LEN], f[NA_LEN];
+	struct ether_addr	*ea;
+	static const u_char	bcast[ETHER_ADDR_LEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	static const u_char	allnodes[ETHER_ADDR_LEN] = {
+		0x33, 0x33, 0x00, 0x00, 0x00, 0x01
+	};
+	static const u_char	all6[16] = {
+		0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01
+	};
+	static const u_char	zero[ETHER_ADDR_LEN];
+
+	if (NULL == (ea = ether_aton(mac))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	bcopy(ea, lladdr, sizeof(lladdr));
+
+	if (-1 == (lock = open(ANNOUNCE_LOCK, O_RDWR | O_CREAT, 0644)))
+		return (-1);
+	if (-1 == announce_link(ngs, eiface, &spliced)) {
+		err = errno;
+		(void) close(lock);
+		errno = err;
+		return (-1);
+	}
+
+	err = 0;
+	for (round = 0; round < count && 0 == err; round++) {
+		if (0 != round) sleep_until(now_ns() + ANNOUNCE_GAP * 1000000LL);
+		for (idx = 0; idx < naddr && 0 == err; idx++) {
+			/* gratuitous ARP is a request for our own address */
+			if (AF_INET == family[idx])
+				len = arp_frame(f, 1, bcast, lladdr, addr[idx],
+				    zero, addr[idx]);
+			else
+				len = na_frame(f, allnodes, lladdr, addr[idx],
+				    all6, ND_NA_FLAG_OVERRIDE);
+			if (-1 == announce_slot(lock) ||
+			    -1 == NgSendData(dsock, "announce", f, len))
+				err = errno;
+		}
+	}
+
+	announce_unlink(ngs, spliced);
+	(void) close(lock);
+	errno = err;
+	return (err ? -1 : 0);
+}
+
+/* ENTRY POINTS */
+
+/* bridge is just shard 0 unless it was sharded, the eiface goes on any shard */
+int
+ngvj_eiface_create(struct ngvj_ctx *ctx, const char *bname, const char *name)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ], eiface[NG_PATHSIZ], shard[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_valid_name(name)))
+		return (rc);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, bname, "bridge")))
+		return (rc);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "nonexistent")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), bname);
+	(void) ngvj_path(eiface, sizeof(eiface), name);
+
+	ngvj_begin(ctx, "pick shard");
+	if (-1 == least_loaded_shard(ctx->csock, bridge, shard, sizeof(shard)))
+		return (ngvj_error(ctx));
+	if (-1 == create_eiface(ctx, shard, eiface,
+	    proxy_running(ctx->csock, bridge)))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+int
+ngvj_eiface_set_mac(struct ngvj_ctx *ctx, const char *name, const char *mac)
+{
+	int	rc;
+	char	eiface[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_valid_mac(mac)))
+		return (rc);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "eiface")))
+		return (rc);
+	(void) ngvj_path(eiface, sizeof(eiface), name);
+
+	ngvj_begin(ctx, "set mac");
+	if (-1 == set_mac(eiface, mac))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/*
+ * Needs NGVJ_ROUTE, and the context should be opened before the eiface is
+ * created so nothing is missed. timeout is in seconds.
+ */
+int
+ngvj_eiface_wait(struct ngvj_ctx *ctx, const char *name, const char *mac,
+    int timeout)
+{
+	int	rc;
+	char	eiface[NG_PATHSIZ];
+
+	if (-1 == ctx->rsock || timeout < 1)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_valid_mac(mac)))
+		return (rc);
+	if (NGVJ_OK != (rc = ngvj_valid_name(name)))
+		return (rc);
+	(void) ngvj_path(eiface, sizeof(eiface), name);
+
+	ngvj_begin(ctx, "wait");
+	if (-1 == wait_eiface(ctx->rsock, eiface, mac, timeout))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/* like create, whichever shard of bridge has the fewest eifaces */
+int
+ngvj_eiface_move(struct ngvj_ctx *ctx, const char *bname, const char *name)
+{
+	int	rc;
+	char	bridge[NG_PATHSIZ], eiface[NG_PATHSIZ], shard[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_check(ctx, bname, "bridge")))
+		return (rc);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "eiface")))
+		return (rc);
+	(void) ngvj_path(bridge, sizeof(bridge), bname);
+	(void) ngvj_path(eiface, sizeof(eiface), name);
+
+	ngvj_begin(ctx, "pick shard");
+	if (-1 == least_loaded_shard(ctx->csock, bridge, shard, sizeof(shard)))
+		return (ngvj_error(ctx));
+	ctx->step = "move";
+	if (-1 == move_eiface(ctx, shard, eiface,
+	    proxy_running(ctx->csock, bridge)))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+int
+ngvj_eiface_destroy(struct ngvj_ctx *ctx, const char *name)
+{
+	int	rc;
+	char	eiface[NG_PATHSIZ];
+
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "eiface")))
+		return (rc);
+	(void) ngvj_path(eiface, sizeof(eiface), name);
+
+	ngvj_begin(ctx, "destroy eiface");
+	if (-1 == destroy_eiface(ctx->csock, eiface))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
+
+
+/*
+ * Gratuitous ARP for each IPv4 and an unsolicited neighbor advertisement for
+ * each IPv6 address, count times, from the eiface at mac. Frames are paced
+ * host wide so this can take a while when many eifaces announce at once.
+ * The context needs NGVJ_DATA, the frames are sent from its socket. Meant
+ * for right after ngvj_eiface_set_mac(), before the jail is started: without
+ * the proxy the link goes down and up again while they are sent.
+ */
+int
+ngvj_eiface_announce(struct ngvj_ctx *ctx, const char *name, const char *mac,
+    const char * const *addrs, int naddr, int count)
+{
+	int	rc, idx;
+	int	family[ANNOUNCE_ADDRS];
+	u_char	addr[ANNOUNCE_ADDRS][16];
+	char	eiface[NG_PATHSIZ];
+
+	if (naddr < 1 || naddr > ANNOUNCE_ADDRS || count < 1 ||
+	    count > NGVJ_ANNOUNCE_MAX)
+		return (NGVJ_EINVAL);
+	for (idx = 0; idx < naddr; idx++) {
+		if (1 == inet_pton(AF_INET, addrs[idx], addr[idx]))
+			family[idx] = AF_INET;
+		else if (1 == inet_pton(AF_INET6, addrs[idx], addr[idx]))
+			family[idx] = AF_INET6;
+		else
+			return (NGVJ_EINVAL);
+	}
+	if (-1 == ctx->dsock)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_valid_mac(mac)))
+		return (rc);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "eiface")))
+		return (rc);
+	(void) ngvj_path(eiface, sizeof(eiface), name);
+
+	ngvj_begin(ctx, "announce");
+	if (-1 == announce(ctx->csock, ctx->dsock, eiface, mac, family, addr,
+	    naddr, count))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
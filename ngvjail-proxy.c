@@ -0,0 +1,960 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+
+#include <time.h>
+#include <arpa/inet.h>
+#include <netgraph/ng_one2many.h>
+
+/*
+ * The ARP and neighbor discovery proxy.
+ *
+ * Every eiface link on the bridge (all shards) gets an ng_bpf
+ *
+ *	bridge:linkN <-> b [bpf] j <-> eiface:ether
+ *	                f  q    r
+ *	                |  |    |
+ *	          many1 [one2many] many0 <-> qID on our socket
+ *	                                     rID
+ *
+ * ng-eiface puts it in when it connects a new eiface, passing everything,
+ * and we adopt it. Links that were there before we started get one spliced
+ * in, which takes them down and up again once.
+ *
+ * ARP requests and neighbor solicitations from the jail go up q to us. If we
+ * know who has the address we answer down r straight back to the jail,
+ * otherwise the request goes back down q and on to the bridge as if nothing
+ * happened. Probes, DAD and gratuitous ARP are never touched.
+ *
+ * The ng_one2many fails over: if we are killed many0 goes with our socket and
+ * requests come back in on f, which sends them on to the bridge. The jails
+ * still get their answers, only not from us, until a new proxy adopts the
+ * link and reconnects many0.
+ *
+ * Going the other way, requests flooded by the bridge only reach the jail if
+ * they are for one of its addresses, provided those were given to us with
+ * ngvj_proxy_bind() (`ng-eiface -c ... -i addr`). If they weren't we can't
+ * know the jail isn't using an address so everything goes through.
+ *
+ * Only bound addresses are answered. Nothing is learned from what jails send,
+ * an address that moved or was taken down would be answered for long after
+ * it stopped being true and the jails asking for it would never find out.
+ */
+
+#define	PROXY_COOKIE	1713484800	/* for bindings sent to the proxy */
+#define	PROXY_BIND	1
+
+#define	PROXY_ADDRS	16	/* bound addresses per eiface and family */
+#define	PROXY_RESCAN	2	/* seconds between looking for new eifaces */
+#define	PROXY_BURST	64	/* frames handled before checking for bindings */
+#define	PROXY_FRAME	9018	/* biggest jumbo frame */
+
+/* what ng-eiface sends the proxy */
+struct proxy_bind {
+	char		eiface[IFNAMSIZ];
+	u_char		mac[ETHER_ADDR_LEN];
+	u_char		family;
+	u_char		addr[16];
+};
+
+struct binding {
+	int		family;
+	u_char		addr[16];
+	u_char		mac[ETHER_ADDR_LEN];
+	char		eiface[IFNAMSIZ];
+};
+
+struct plink {
+	ng_ID_t		bpf;
+	ng_ID_t		o2m;			/* the one2many on q */
+	ng_ID_t		eid;			/* the eiface */
+	char		eiface[NG_NODESIZ];
+	char		shard[NG_PATHSIZ];
+	char		hook[NG_HOOKSIZ];
+	int		hooks;			/* on the bpf, at the last rescan */
+};
+
+struct ngvj_proxy {
+	int		bsock;		/* named so it can be found, only gets bindings */
+	char		bridge[NG_PATHSIZ];
+	time_t		rescan;
+	struct plink	*link;
+	int		nlink;
+	int		maxlink;
+	struct binding	*bind;
+	int		nbind;
+	int		maxbind;
+	struct ngvj_proxy_stats stats;
+	u_char		frame[PROXY_FRAME];
+};
+
+
+static time_t
+uptime(void)
+{
+	struct timespec	ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
+
+
+static int
+addr_len(int family)
+{
+	return ((AF_INET == family) ? 4 : 16);
+}
+
+
+/* BINDINGS */
+
+static struct binding *
+bind_find(struct ngvj_proxy *px, int family, const u_char *addr)
+{
+	int		idx;
+	struct binding	*b;
+
+	for (idx = 0; idx < px->nbind; idx++) {
+		b = &px->bind[idx];
+		if (b->family == family &&
+		    0 == bcmp(b->addr, addr, addr_len(family)))
+			return (b);
+	}
+	return (NULL);
+}
+
+
+static struct binding *
+bind_new(struct ngvj_proxy *px)
+{
+	struct binding	*b;
+
+	if (px->nbind == px->maxbind) {
+		b = realloc(px->bind, (px->maxbind + 64) * sizeof(*b));
+		if (NULL == b) return (NULL);
+		px->bind = b;
+		px->maxbind += 64;
+	}
+	b = &px->bind[px->nbind++];
+	bzero(b, sizeof(*b));
+	return (b);
+}
+
+
+/* keep things packed, order doesn't matter */
+static void
+bind_drop(struct ngvj_proxy *px, struct binding *b)
+{
+	*b = px->bind[--px->nbind];
+}
+
+
+/* an answer, or NULL to let the request go on to the bridge */
+static struct binding *
+bind_answer(struct ngvj_proxy *px, int family, const u_char *addr,
+    const u_char *asker)
+{
+	struct binding	*b;
+
+	if (NULL == (b = bind_find(px, family, addr))) return (NULL);
+	/* nobody needs telling their own address */
+	if (0 == bcmp(b->mac, asker, ETHER_ADDR_LEN)) return (NULL);
+	return (b);
+}
+
+
+/* what a link leaves behind when it goes */
+static void
+bind_forget(struct ngvj_proxy *px, const struct plink *pl)
+{
+	int		idx;
+	struct binding	*b;
+
+	for (idx = px->nbind - 1; idx >= 0; idx--) {
+		b = &px->bind[idx];
+		if (0 == strcmp(b->eiface, pl->eiface))
+			bind_drop(px, b);
+	}
+}
+
+
+/* PROGRAMS */
+
+/*
+ * Jumps are given as absolute instruction numbers, which is a lot easier to
+ * get right than counting forwards by hand. -1 for an instruction that isn't
+ * a jump.
+ */
+static void
+emit(struct bpf_insn *prog, int *pc, u_short code, u_int k, int jt, int jf)
+{
+	struct bpf_insn	*insn = &prog[*pc];
+
+	insn->code = code;
+	insn->k = k;
+	insn->jt = (jt < 0) ? 0 : jt - *pc - 1;
+	insn->jf = (jf < 0) ? 0 : jf - *pc - 1;
+	(*pc)++;
+}
+
+#define	LD(w, off)	emit(prog, &pc, BPF_LD + (w) + BPF_ABS, off, -1, -1)
+#define	JEQ(k, t, f)	emit(prog, &pc, BPF_JMP + BPF_JEQ + BPF_K, k, t, f)
+
+/*
+ * From the jail: ARP requests that aren't probes (no sender address) or
+ * gratuitous (sender is target), and solicitations that aren't DAD (from ::)
+ * match and go to us. Everything else goes to the bridge.
+ */
+static int
+jail_prog(struct bpf_insn *prog)
+{
+	int		pc = 0;
+	const int	us = 22, bridge = 23;
+
+	LD(BPF_H, OFF_TYPE);					/* 0 */
+	JEQ(ETHERTYPE_ARP, 2, 9);
+	LD(BPF_H, OFF_ARP_OP);					/* 2 */
+	JEQ(1, 4, bridge);
+	LD(BPF_W, OFF_ARP_SPA);
+	JEQ(0, bridge, 6);
+	emit(prog, &pc, BPF_MISC + BPF_TAX, 0, -1, -1);		/* 6 */
+	LD(BPF_W, OFF_ARP_TPA);
+	emit(prog, &pc, BPF_JMP + BPF_JEQ + BPF_X, 0, bridge, us);
+	JEQ(ETHERTYPE_IPV6, 10, bridge);			/* 9 */
+	LD(BPF_B, OFF_IP6_NXT);
+	JEQ(IPPROTO_ICMPV6, 12, bridge);
+	LD(BPF_B, OFF_ICMP6);					/* 12 */
+	JEQ(ND_NEIGHBOR_SOLICIT, 14, bridge);
+	LD(BPF_W, OFF_IP6_SRC);
+	JEQ(0, 16, us);
+	LD(BPF_W, OFF_IP6_SRC + 4);				/* 16 */
+	JEQ(0, 18, us);
+	LD(BPF_W, OFF_IP6_SRC + 8);
+	JEQ(0, 20, us);
+	LD(BPF_W, OFF_IP6_SRC + 12);				/* 20 */
+	JEQ(0, bridge, us);
+	emit(prog, &pc, BPF_RET + BPF_K, (u_int) -1, -1, -1);	/* 22 */
+	emit(prog, &pc, BPF_RET + BPF_K, 0, -1, -1);		/* 23 */
+	return (pc);
+}
+
+
+/*
+ * To the jail: with the addresses bound to this eiface, drop requests for
+ * any other address of that family. Gratuitous ARP (sender is target) is a
+ * neighbour saying where it is now and always goes through. 8 instructions for each IPv6 address and
+ * PROXY_ADDRS of them keeps every jump well inside the 255 a bpf jump can do.
+ */
+static int
+eiface_prog(struct ngvj_proxy *px, const struct plink *pl, struct bpf_insn *prog)
+{
+	int		idx, word, pc, n4, n6, arp, nd, drop, pass;
+	u_int		k;
+	struct binding	*b;
+	struct binding	*v4[PROXY_ADDRS], *v6[PROXY_ADDRS];
+
+	n4 = n6 = 0;
+	for (idx = 0; idx < px->nbind; idx++) {
+		b = &px->bind[idx];
+		if (0 != strcmp(b->eiface, pl->eiface))
+			continue;
+		if (AF_INET == b->family && n4 < PROXY_ADDRS)
+			v4[n4++] = b;
+		if (AF_INET6 == b->family && n6 < PROXY_ADDRS)
+			v6[n6++] = b;
+	}
+
+	arp = 2;
+	nd = arp + (n4 ? 6 + n4 : 0);
+	drop = nd + (n6 ? 5 + 8 * n6 : 0);
+	pass = drop + 1;
+	if (0 == n4) arp = pass;
+	if (0 == n6) nd = pass;
+
+	pc = 0;
+	LD(BPF_H, OFF_TYPE);
+	JEQ(ETHERTYPE_ARP, arp, -1);
+	/* jf gets fixed up here since nd is after the ARP part */
+	prog[1].jf = nd - 2;
+	if (n4) {
+		LD(BPF_H, OFF_ARP_OP);
+		JEQ(1, pc + 1, pass);
+		LD(BPF_W, OFF_ARP_SPA);
+		emit(prog, &pc, BPF_MISC + BPF_TAX, 0, -1, -1);
+		LD(BPF_W, OFF_ARP_TPA);
+		emit(prog, &pc, BPF_JMP + BPF_JEQ + BPF_X, 0, pass, pc + 1);
+		for (idx = 0; idx < n4; idx++) {
+			bcopy(v4[idx]->addr, &k, sizeof(k));
+			JEQ(ntohl(k), pass, (idx + 1 < n4) ? pc + 1 : drop);
+		}
+	}
+	if (n6) {
+		JEQ(ETHERTYPE_IPV6, pc + 1, pass);
+		LD(BPF_B, OFF_IP6_NXT);
+		JEQ(IPPROTO_ICMPV6, pc + 1, pass);
+		LD(BPF_B, OFF_ICMP6);
+		JEQ(ND_NEIGHBOR_SOLICIT, pc + 1, pass);
+		for (idx = 0; idx < n6; idx++) {
+			int next = (idx + 1 < n6) ? pc + 8 : drop;
+
+			for (word = 0; word < 4; word++) {
+				bcopy(v6[idx]->addr + 4 * word, &k, sizeof(k));
+				LD(BPF_W, OFF_ND_TARGET + 4 * word);
+				JEQ(ntohl(k), (3 == word) ? pass : pc + 1, next);
+			}
+		}
+	}
+	emit(prog, &pc, BPF_RET + BPF_K, 0, -1, -1);		/* drop */
+	emit(prog, &pc, BPF_RET + BPF_K, (u_int) -1, -1, -1);	/* pass */
+	return (pc);
+}
+
+#undef	LD
+#undef	JEQ
+
+static const struct bpf_insn match_all[] = {
+	BPF_STMT(BPF_RET + BPF_K, (u_int) -1)
+};
+
+#define	PROXY_INSNS	(8 + (6 + PROXY_ADDRS) + (5 + 8 * PROXY_ADDRS))
+
+static int
+set_eiface_prog(int ngs, struct ngvj_proxy *px, const struct plink *pl)
+{
+	int		len;
+	char		bpf[NG_PATHSIZ];
+	struct bpf_insn	prog[PROXY_INSNS];
+
+	(void) snprintf(bpf, sizeof(bpf), "[%x]:", pl->bpf);
+	len = eiface_prog(px, pl, prog);
+	return (set_bpf_prog(ngs, bpf, "b", "j", "", prog, len));
+}
+
+
+/* LINKS */
+
+/*
+ * The one2many on the bpf's q hook, with many1 back to f. Set to fail over
+ * so whatever comes in on "one" goes to many0 (us) while it is connected and
+ * to many1 (the bridge) when it isn't.
+ */
+static int
+link_failover(int ngs, const char *bpf, ng_ID_t *o2m)
+{
+	char			path[NG_PATHSIZ];
+	struct ng_mesg		*resp;
+	struct ng_one2many_config conf;
+	struct ngm_mkpeer	mp = {
+		.type = NG_ONE2MANY_NODE_TYPE,
+		.ourhook = "q",
+		.peerhook = NG_ONE2MANY_HOOK_ONE
+	};
+	struct ngm_connect	cn = {
+		.path = "q",
+		.ourhook = "f",
+		.peerhook = NG_ONE2MANY_HOOK_MANY_PREFIX "1"
+	};
+
+	if (-1 == NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)) ||
+	    -1 == NgSendMsg(ngs, bpf, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		return (-1);
+
+	(void) snprintf(path, sizeof(path), "%sq", bpf);
+	bzero(&conf, sizeof(conf));
+	conf.xmitAlg = NG_ONE2MANY_XMIT_FAILOVER;
+	conf.failAlg = NG_ONE2MANY_FAIL_MANUAL;
+	conf.enabledLinks[0] = conf.enabledLinks[1] = 1;
+	if (-1 == NgSendMsg(ngs, path, NGM_ONE2MANY_COOKIE, NGM_ONE2MANY_SET_CONFIG,
+	    &conf, sizeof(conf)))
+		return (-1);
+	if (-1 == ng_ask(ngs, path, NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0, &resp))
+		return (-1);
+	*o2m = ((struct nodeinfo *) resp->data)->id;
+	free(resp);
+	return (set_bpf_prog(ngs, bpf, "f", "b", "", match_all, 1));
+}
+
+
+/* our two hooks, to the bpf and its one2many, and the programs that go with them */
+static int
+link_hooks(int ngs, const char *bpf, ng_ID_t id, ng_ID_t o2m)
+{
+	struct ngm_connect	cn;
+
+	(void) strlcpy(cn.path, bpf, sizeof(cn.path));
+	(void) snprintf(cn.ourhook, sizeof(cn.ourhook), "r%x", id);
+	(void) strlcpy(cn.peerhook, "r", sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		return (-1);
+	(void) snprintf(cn.path, sizeof(cn.path), "[%x]:", o2m);
+	(void) snprintf(cn.ourhook, sizeof(cn.ourhook), "q%x", id);
+	(void) strlcpy(cn.peerhook, NG_ONE2MANY_HOOK_MANY_PREFIX "0",
+	    sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		return (-1);
+	if (-1 == set_bpf_prog(ngs, bpf, "r", "j", "", match_all, 1))
+		return (-1);
+	if (-1 == set_bpf_prog(ngs, bpf, "q", "b", "", match_all, 1))
+		return (-1);
+	return (0);
+}
+
+
+/*
+ * The bpf and the one2many behind it, either may be gone already. A
+ * one2many we never got the ID of only has hooks to the bpf and goes with it.
+ */
+static void
+link_shutdown(int ngs, ng_ID_t bpf, ng_ID_t o2m)
+{
+	char		path[NG_PATHSIZ];
+
+	if (0 != o2m) {
+		(void) snprintf(path, sizeof(path), "[%x]:", o2m);
+		(void) NgSendMsg(ngs, path, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+	}
+	(void) snprintf(path, sizeof(path), "[%x]:", bpf);
+	(void) NgSendMsg(ngs, path, NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+}
+
+
+static struct plink *
+link_new(struct ngvj_proxy *px)
+{
+	struct plink	*pl;
+
+	if (px->nlink == px->maxlink) {
+		pl = realloc(px->link, (px->maxlink + 64) * sizeof(*pl));
+		if (NULL == pl) return (NULL);
+		px->link = pl;
+		px->maxlink += 64;
+	}
+	pl = &px->link[px->nlink++];
+	bzero(pl, sizeof(*pl));
+	return (pl);
+}
+
+
+/*
+ * Put a bpf in shard:hook <-> eiface. Like a tap, everything is set up on
+ * our side first. The eiface does see its link go down and up again.
+ */
+static int
+link_splice(int ngs, struct ngvj_proxy *px, const char *shard, const char *hook,
+    const struct nodeinfo *eif)
+{
+	int			err;
+	ng_ID_t			id, o2m;
+	char			bpf[NG_PATHSIZ], eiface[NG_PATHSIZ];
+	struct ng_mesg		*resp;
+	struct plink		*pl;
+	struct bpf_insn		prog[PROXY_INSNS];
+	struct ngm_rmhook	rm = {
+		.ourhook = "new"
+	};
+	struct ngm_mkpeer	mp = {
+		.type = "bpf",
+		.ourhook = "new",
+		.peerhook = "new"
+	};
+	struct ngm_connect	cn;
+
+	(void) snprintf(eiface, sizeof(eiface), "[%x]:", eif->id);
+	if (-1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_MKPEER, &mp, sizeof(mp)))
+		return (-1);
+	if (-1 == ng_ask(ngs, ".:new", NGM_GENERIC_COOKIE, NGM_NODEINFO, NULL, 0,
+	    &resp)) {
+		err = errno;
+		(void) NgSendMsg(ngs, ".:new", NGM_GENERIC_COOKIE, NGM_SHUTDOWN, NULL, 0);
+		errno = err;
+		return (-1);
+	}
+	id = ((struct nodeinfo *) resp->data)->id;
+	free(resp);
+	(void) snprintf(bpf, sizeof(bpf), "[%x]:", id);
+
+	/* "new" was only to find it, the hooks are named after it */
+	o2m = 0;
+	if (-1 == link_failover(ngs, bpf, &o2m) ||
+	    -1 == link_hooks(ngs, bpf, id, o2m) ||
+	    -1 == NgSendMsg(ngs, ".:", NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm)))
+		goto fail;
+
+	if (NULL == (pl = link_new(px)))
+		goto fail;
+	pl->bpf = id;
+	pl->o2m = o2m;
+	pl->hooks = 5;
+	pl->eid = eif->id;
+	(void) strlcpy(pl->eiface, eif->name, sizeof(pl->eiface));
+	(void) strlcpy(pl->shard, shard, sizeof(pl->shard));
+	(void) strlcpy(pl->hook, hook, sizeof(pl->hook));
+
+	/* now the only part anybody on the bridge can notice */
+	(void) strlcpy(rm.ourhook, hook, sizeof(rm.ourhook));
+	if (-1 == NgSendMsg(ngs, shard, NGM_GENERIC_COOKIE, NGM_RMHOOK, &rm, sizeof(rm)))
+		goto forget;
+	(void) strlcpy(cn.ourhook, hook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "b", sizeof(cn.peerhook));
+	(void) strlcpy(cn.path, bpf, sizeof(cn.path));
+	if (-1 == NgSendMsg(ngs, shard, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+	if (-1 == set_eiface_prog(ngs, px, pl))
+		goto restore;
+	(void) strlcpy(cn.ourhook, "ether", sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "j", sizeof(cn.peerhook));
+	if (-1 == NgSendMsg(ngs, eiface, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn)))
+		goto restore;
+	if (-1 == set_bpf_prog(ngs, bpf, "j", "q", "b", prog, jail_prog(prog)))
+		goto restore;
+	return (0);
+
+restore:
+	err = errno;
+	link_shutdown(ngs, id, o2m);
+	(void) strlcpy(cn.path, eiface, sizeof(cn.path));
+	(void) strlcpy(cn.ourhook, hook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "ether", sizeof(cn.peerhook));
+	(void) NgSendMsg(ngs, shard, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn));
+	px->nlink--;
+	errno = err;
+	return (-1);
+
+forget:
+	px->nlink--;
+fail:
+	err = errno;
+	link_shutdown(ngs, id, o2m);
+	errno = err;
+	return (-1);
+}
+
+
+/*
+ * A bpf of ours we don't know about, either fresh from ng-eiface with only b
+ * and j or left by a proxy that was killed. If its eiface is still there take
+ * it over, else get rid of it. A killed proxy's one2many has been sending the
+ * jail's requests to the bridge since, reconnecting many0 is enough to get
+ * them back. Storm control's bpf has no "b" hook and is left alone.
+ */
+static int
+link_adopt(int ngs, struct ngvj_proxy *px, const char *shard, const char *hook,
+    ng_ID_t id)
+{
+	int		idx, ours, rc;
+	ng_ID_t		o2m;
+	char		bpf[NG_PATHSIZ];
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct linkinfo	*jail;
+	struct plink	*pl;
+	struct bpf_insn	prog[PROXY_INSNS];
+
+	(void) snprintf(bpf, sizeof(bpf), "[%x]:", id);
+	if (-1 == ng_list_hooks(ngs, bpf, &resp)) return (-1);
+
+	hlist = (struct hooklist *) resp->data;
+	ours = 0;
+	o2m = 0;
+	jail = NULL;
+	for (idx = 0; idx < hlist->nodeinfo.hooks; idx++) {
+		struct linkinfo *const link = &hlist->link[idx];
+
+		if (0 == strcmp(link->ourhook, "b")) ours = 1;
+		if (0 == strcmp(link->ourhook, "j") &&
+		    0 == strcmp(link->nodeinfo.type, "eiface"))
+			jail = link;
+		if (0 == strcmp(link->ourhook, "q") &&
+		    0 == strcmp(link->nodeinfo.type, NG_ONE2MANY_NODE_TYPE))
+			o2m = link->nodeinfo.id;
+	}
+	rc = 0;
+	if (ours && NULL == jail) {
+		link_shutdown(ngs, id, o2m);
+	} else if (ours) {
+		if (NULL == (pl = link_new(px))) {
+			free(resp);
+			return (-1);
+		}
+		pl->bpf = id;
+		pl->o2m = o2m;
+		pl->hooks = 5;
+		pl->eid = jail->nodeinfo.id;
+		(void) strlcpy(pl->eiface, jail->nodeinfo.name, sizeof(pl->eiface));
+		(void) strlcpy(pl->shard, shard, sizeof(pl->shard));
+		(void) strlcpy(pl->hook, hook, sizeof(pl->hook));
+		/* somebody took the one2many away, nothing else is on q or f */
+		if ((0 == o2m && -1 == link_failover(ngs, bpf, &pl->o2m)) ||
+		    -1 == link_hooks(ngs, bpf, id, pl->o2m) ||
+		    -1 == set_eiface_prog(ngs, px, pl) ||
+		    -1 == set_bpf_prog(ngs, bpf, "j", "q", "b", prog, jail_prog(prog)))
+			rc = -1;
+	}
+	free(resp);
+	return ((-1 == rc) ? -1 : 0);
+}
+
+
+/* take the bpf out and put the link back, if there is still a link */
+static void
+link_unsplice(int ngs, struct ngvj_proxy *px, int idx)
+{
+	struct plink		*pl = &px->link[idx];
+	struct ngm_connect	cn;
+
+	link_shutdown(ngs, pl->bpf, pl->o2m);
+	(void) snprintf(cn.path, sizeof(cn.path), "[%x]:", pl->eid);
+	(void) strlcpy(cn.ourhook, pl->hook, sizeof(cn.ourhook));
+	(void) strlcpy(cn.peerhook, "ether", sizeof(cn.peerhook));
+	(void) NgSendMsg(ngs, pl->shard, NGM_GENERIC_COOKIE, NGM_CONNECT, &cn, sizeof(cn));
+
+	bind_forget(px, pl);
+	*pl = px->link[--px->nlink];
+}
+
+
+static struct plink *
+link_find(struct ngvj_proxy *px, ng_ID_t id)
+{
+	int	idx;
+
+	for (idx = 0; idx < px->nlink; idx++)
+		if (px->link[idx].bpf == id) return (&px->link[idx]);
+	return (NULL);
+}
+
+
+/*
+ * New eifaces get a bpf, and ours whose eiface went away (destroyed or
+ * moved) are taken out. A bpf with all five hooks is left alone. The shard
+ * lists already have the hook count of every bpf right on a shard, only one
+ * with a tap in front of it is asked.
+ */
+static int
+rescan(int ngs, struct ngvj_proxy *px)
+{
+	int		idx, shards, shard;
+	char		path[NG_PATHSIZ];
+	struct ng_mesg	*resp;
+	struct hooklist *hlist;
+	struct plink	*pl;
+
+	px->rescan = uptime() + PROXY_RESCAN;
+	for (idx = 0; idx < px->nlink; idx++)
+		px->link[idx].hooks = -1;
+
+	shards = shard_count(ngs, px->bridge);
+	for (shard = 0; shard < shards; shard++) {
+		shard_path(path, sizeof(path), px->bridge, shard);
+		if (-1 == ng_list_hooks(ngs, path, &resp)) return (-1);
+
+		hlist = (struct hooklist *) resp->data;
+		for (idx = 0; idx < hlist->nodeinfo.hooks; idx++) {
+			struct linkinfo *const link = &hlist->link[idx];
+			const char *type = link->nodeinfo.type;
+
+			if (0 == strcmp(type, "eiface")) {
+				(void) link_splice(ngs, px, path, link->ourhook,
+				    &link->nodeinfo);
+			} else if (0 != strcmp(type, "bpf")) {
+				continue;
+			} else if (NULL != (pl = link_find(px, link->nodeinfo.id))) {
+				pl->hooks = link->nodeinfo.hooks;
+			} else {
+				(void) link_adopt(ngs, px, path, link->ourhook,
+				    link->nodeinfo.id);
+			}
+		}
+		free(resp);
+	}
+
+	for (idx = px->nlink - 1; idx >= 0; idx--) {
+		pl = &px->link[idx];
+		if (-1 == pl->hooks) {
+			(void) snprintf(path, sizeof(path), "[%x]:", pl->bpf);
+			pl->hooks = ng_hooks(ngs, path);
+		}
+		/* a sixth is ng-eiface announcing through it */
+		if (pl->hooks < 5)
+			link_unsplice(ngs, px, idx);
+	}
+	return (0);
+}
+
+
+/* FRAMES */
+
+static void
+answer_arp(struct ngvj_proxy *px, int dsock, const char *reply,
+    const u_char *req, const struct binding *b)
+{
+	int	len;
+
+	len = arp_frame(px->frame, 2, req + OFF_ARP_SHA, b->mac, b->addr,
+	    req + OFF_ARP_SHA, req + OFF_ARP_SPA);
+	if (-1 != NgSendData(dsock, reply, px->frame, len))
+		px->stats.answered++;
+}
+
+
+static void
+answer_nd(struct ngvj_proxy *px, int dsock, const char *reply,
+    const u_char *req, const struct binding *b)
+{
+	int	len;
+
+	len = na_frame(px->frame, req + ETHER_ADDR_LEN, b->mac, b->addr,
+	    req + OFF_IP6_SRC, ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE);
+	if (-1 != NgSendData(dsock, reply, px->frame, len))
+		px->stats.answered++;
+}
+
+
+static void
+frame(int dsock, struct ngvj_proxy *px, u_char *f, int len, const char *hook)
+{
+	ng_ID_t			id;
+	struct binding		*b;
+	char			reply[NG_HOOKSIZ];
+	u_short			type;
+
+	/* frames only ever come up q<bpf ID> */
+	id = (ng_ID_t) strtoul(hook + 1, NULL, 16);
+	(void) snprintf(reply, sizeof(reply), "r%x", id);
+
+	type = (len > OFF_TYPE + 1) ? (f[OFF_TYPE] << 8) | f[OFF_TYPE + 1] : 0;
+	if (ETHERTYPE_ARP == type && len >= ARP_LEN) {
+		b = bind_answer(px, AF_INET, f + OFF_ARP_TPA, f + OFF_ARP_SHA);
+		if (NULL != b) {
+			answer_arp(px, dsock, reply, f, b);
+			return;
+		}
+	} else if (ETHERTYPE_IPV6 == type && len >= OFF_ND_OPT) {
+		b = bind_answer(px, AF_INET6, f + OFF_ND_TARGET,
+		    f + ETHER_ADDR_LEN);
+		if (NULL != b) {
+			answer_nd(px, dsock, reply, f, b);
+			return;
+		}
+	}
+	/* a miss, on to the bridge as if we were never there */
+	if (-1 != NgSendData(dsock, hook, f, len))
+		px->stats.forwarded++;
+}
+
+
+static void
+binding(int ngs, struct ngvj_proxy *px, const struct proxy_bind *pb)
+{
+	int		idx, count;
+	struct binding	*b;
+
+	if (AF_INET != pb->family && AF_INET6 != pb->family) return;
+
+	count = 0;
+	for (idx = 0; idx < px->nbind; idx++) {
+		b = &px->bind[idx];
+		if (b->family == pb->family &&
+		    0 == strncmp(b->eiface, pb->eiface, sizeof(pb->eiface)))
+			count++;
+	}
+	if (count >= PROXY_ADDRS) return;
+
+	/* a later binding beats an earlier one */
+	if (NULL == (b = bind_find(px, pb->family, pb->addr)) &&
+	    NULL == (b = bind_new(px)))
+		return;
+	b->family = pb->family;
+	bcopy(pb->addr, b->addr, addr_len(pb->family));
+	bcopy(pb->mac, b->mac, ETHER_ADDR_LEN);
+	(void) strlcpy(b->eiface, pb->eiface, sizeof(b->eiface));
+
+	/* reprogram it now if it is spliced already, else the rescan will */
+	for (idx = 0; idx < px->nlink; idx++)
+		if (0 == strcmp(px->link[idx].eiface, b->eiface))
+			(void) set_eiface_prog(ngs, px, &px->link[idx]);
+	px->rescan = 0;
+}
+
+
+/* ENTRY POINTS */
+
+/*
+ * The context needs NGVJ_DATA and is the proxy for the bridge until
+ * ngvj_proxy_stop() or ngvj_close(). Only one proxy per bridge.
+ */
+int
+ngvj_proxy_start(struct ngvj_ctx *ctx, const char *name)
+{
+	int			rc;
+	char			node[NG_NODESIZ];
+	struct ngvj_proxy	*px;
+
+	if (-1 == ctx->dsock || NULL != ctx->proxy)
+		return (NGVJ_EINVAL);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, name, "bridge")))
+		return (rc);
+	(void) snprintf(node, sizeof(node), "%s-proxy", name);
+	if (NGVJ_OK != (rc = ngvj_check(ctx, node, "nonexistent")))
+		return (rc);
+
+	ngvj_begin(ctx, "proxy");
+	if (NULL == (px = calloc(1, sizeof(*px))))
+		return (ngvj_error(ctx));
+	(void) ngvj_path(px->bridge, sizeof(px->bridge), name);
+	if (-1 == NgMkSockNode(node, &px->bsock, NULL)) {
+		rc = ngvj_error(ctx);
+		free(px);
+		return (rc);
+	}
+	ctx->proxy = px;
+
+	ctx->step = "proxy links";
+	if (-1 == rescan(ctx->csock, px)) {
+		rc = ngvj_error(ctx);
+		(void) ngvj_proxy_stop(ctx);
+		return (rc);
+	}
+	return (NGVJ_OK);
+}
+
+
+/*
+ * Handle whatever turns up in the next timeout milliseconds. NGVJ_ENOENT
+ * once the bridge is gone. A signal just makes it return early.
+ */
+int
+ngvj_proxy_run(struct ngvj_ctx *ctx, int timeout)
+{
+	int			rc, count;
+	char			hook[NG_HOOKSIZ];
+	struct ngvj_proxy	*px = ctx->proxy;
+	union {
+		struct ng_mesg	msg;
+		u_char		buf[sizeof(struct ng_mesg) +
+				    sizeof(struct proxy_bind) + 64];
+	}			m;
+	struct pollfd		pfd[2];
+
+	if (NULL == px)
+		return (NGVJ_EINVAL);
+	ngvj_begin(ctx, "proxy");
+
+	pfd[0].fd = ctx->dsock;
+	pfd[1].fd = px->bsock;
+	pfd[0].events = pfd[1].events = POLLIN;
+	if (-1 == (rc = poll(pfd, 2, timeout)))
+		return ((EINTR == errno) ? NGVJ_OK : ngvj_error(ctx));
+
+	for (count = 0; count < PROXY_BURST && (pfd[0].revents & POLLIN); count++) {
+		if (-1 == (rc = NgRecvData(ctx->dsock, px->frame,
+		    sizeof(px->frame), hook)))
+			break;
+		frame(ctx->dsock, px, px->frame, rc, hook);
+		if (1 != poll(pfd, 1, 0)) break;
+	}
+	if (pfd[1].revents & POLLIN) {
+		rc = NgRecvMsg(px->bsock, &m.msg, sizeof(m), NULL);
+		if (rc > 0 && PROXY_COOKIE == m.msg.header.typecookie &&
+		    PROXY_BIND == m.msg.header.cmd &&
+		    sizeof(struct proxy_bind) == m.msg.header.arglen)
+			binding(ctx->csock, px, (struct proxy_bind *) m.msg.data);
+	}
+
+	if (uptime() >= px->rescan) {
+		ctx->step = "proxy links";
+		if (-1 == rescan(ctx->csock, px))
+			return (ngvj_error(ctx));
+	}
+	return (NGVJ_OK);
+}
+
+
+/* every link is put back the way it was */
+int
+ngvj_proxy_stop(struct ngvj_ctx *ctx)
+{
+	struct ngvj_proxy	*px = ctx->proxy;
+
+	if (NULL == px)
+		return (NGVJ_EINVAL);
+	while (px->nlink > 0)
+		link_unsplice(ctx->csock, px, px->nlink - 1);
+	(void) close(px->bsock);
+	free(px->link);
+	free(px->bind);
+	free(px);
+	ctx->proxy = NULL;
+	return (NGVJ_OK);
+}
+
+
+int
+ngvj_proxy_stats(struct ngvj_ctx *ctx, struct ngvj_proxy_stats *st)
+{
+	if (NULL == ctx->proxy)
+		return (NGVJ_EINVAL);
+	*st = ctx->proxy->stats;
+	return (NGVJ_OK);
+}
+
+
+/*
+ * Tell the bridge's proxy eiface has addr (IPv4 or IPv6) at mac. NGVJ_ENOENT
+ * if there is no proxy running for the bridge.
+ */
+int
+ngvj_proxy_bind(struct ngvj_ctx *ctx, const char *bridge, const char *eiface,
+    const char *mac, const char *addr)
+{
+	int			rc;
+	char			node[NG_PATHSIZ];
+	struct ether_addr	*ea;
+	struct proxy_bind	pb;
+
+	if (NGVJ_OK != (rc = ngvj_valid_name(bridge)) ||
+	    NGVJ_OK != (rc = ngvj_valid_name(eiface)) ||
+	    NGVJ_OK != (rc = ngvj_valid_mac(mac)) || NULL == addr)
+		return (NGVJ_EINVAL);
+
+	bzero(&pb, sizeof(pb));
+	(void) strlcpy(pb.eiface, eiface, sizeof(pb.eiface));
+	if (NULL == (ea = ether_aton(mac)))
+		return (NGVJ_EINVAL);
+	bcopy(ea, pb.mac, sizeof(pb.mac));
+	if (1 == inet_pton(AF_INET, addr, pb.addr))
+		pb.family = AF_INET;
+	else if (1 == inet_pton(AF_INET6, addr, pb.addr))
+		pb.family = AF_INET6;
+	else
+		return (NGVJ_EINVAL);
+
+	ngvj_begin(ctx, "bind");
+	(void) snprintf(node, sizeof(node), "%s-proxy:", bridge);
+	if (-1 == NgSendMsg(ctx->csock, node, PROXY_COOKIE, PROXY_BIND,
+	    &pb, sizeof(pb)))
+		return (ngvj_error(ctx));
+	return (NGVJ_OK);
+}
@@ -0,0 +1,236 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "common.h"
+
+#include <net/route.h>
+
+/* indexed by the NGVJ_E* codes */
+static const char * const Errors[NGVJ_NERR] = {
+	"no error",
+	"system error",
+	"invalid argument",
+	"no such node",
+	"node already exists",
+	"node is the wrong type",
+	"already connected to a bridge",
+	"timed out"
+};
+
+
+/*
+ * Our socket node is left unnamed, netgraph gives it an ID and a process can
+ * have as many of these open as it likes without the names colliding.
+ */
+int
+ngvj_open(struct ngvj_ctx *ctx, int flags)
+{
+	bzero(ctx, sizeof(*ctx));
+	ctx->csock = -1;
+	ctx->dsock = -1;
+	ctx->rsock = -1;
+	ngvj_begin(ctx, "socket node");
+
+	if (-1 == NgMkSockNode(NULL, &ctx->csock,
+	    (flags & NGVJ_DATA) ? &ctx->dsock : NULL))
+		return (ngvj_error(ctx));
+
+	/*
+	 * Open this before any eiface is created, that way no event can slip
+	 * by between making a change and starting to wait for it. Only
+	 * interface arrivals and status changes are of any interest.
+	 */
+	if (flags & NGVJ_ROUTE) {
+#ifdef	ROUTE_MSGFILTER
+		unsigned int	filter;
+#endif
+
+		ctx->step = "routing socket";
+		if (-1 == (ctx->rsock = socket(PF_ROUTE, SOCK_RAW, AF_UNSPEC))) {
+			int rc = ngvj_error(ctx);
+
+			ngvj_close(ctx);
+			return (rc);
+		}
+#ifdef	ROUTE_MSGFILTER
+		filter = ROUTE_FILTER(RTM_IFINFO) | ROUTE_FILTER(RTM_IFANNOUNCE);
+		(void) setsockopt(ctx->rsock, PF_ROUTE, ROUTE_MSGFILTER,
+		    &filter, sizeof(filter));
+#endif
+	}
+	return (NGVJ_OK);
+}
+
+
+void
+ngvj_close(struct ngvj_ctx *ctx)
+{
+	/* the links it spliced go back the way they were */
+	if (NULL != ctx->proxy) (void) ngvj_proxy_stop(ctx);
+	if (-1 != ctx->csock) (void) close(ctx->csock);
+	if (-1 != ctx->dsock) (void) close(ctx->dsock);
+	if (-1 != ctx->rsock) (void) close(ctx->rsock);
+	ctx->csock = ctx->dsock = ctx->rsock = -1;
+}
+
+
+/*
+ * For a failed system or netgraph call this says what we were doing and
+ * why it failed, the string is in ctx and good until the next call.
+ */
+const char *
+ngvj_strerror(struct ngvj_ctx *ctx, int err)
+{
+	if (err < 0 || err >= NGVJ_NERR)
+		return ("unknown error");
+	if (NGVJ_OK == err || 0 == ctx->sys_errno || NULL == ctx->step)
+		return (Errors[err]);
+	(void) snprintf(ctx->msg, sizeof(ctx->msg), "%s: %s",
+	    ctx->step, strerror(ctx->sys_errno)
+	);
+	return (ctx->msg);
+}
+
+
+int
+ngvj_valid_name(const char *node)
+{
+	if (NULL == node) return (NGVJ_EINVAL);
+	if (strlen(node) >= IFNAMSIZ) return (NGVJ_EINVAL);
+	/* only allow a-zA-Z0-9 and '-' itself
+	 * A-z is (65,122]
+	 * 0-9 is (48,57]
+	 * - is 45
+	 * ':' is a netgraph separator, '[' and ']' indicate IDs in netgraph
+	 * and really this is going to be a system interface name so that's
+	 * allyou need.
+	 */
+	while('\0' != *node) {
+		if (45 == *node ||
+		    (*node >= 48 && *node <= 57) ||
+		    (*node >= 65 && *node <= 122)
+		) {
+			node++;
+			continue;
+		} else {
+			return (NGVJ_EINVAL);
+		}
+	}
+	return (NGVJ_OK);
+}
+
+
+/*
+ * A valid mac string is "bb:bb:bb:bb:bb:bb", where b is a char 0-9a-fA-F.
+ * Not checking that it is un-used on this system, much less that it isn't
+ * in the ARP cache. Besides that cache may be incomplete. Its your job to
+ * pick something unique! This just lets us give a useful error when the
+ * mac string isn't right.
+ */
+int
+ngvj_valid_mac(const char *mac)
+{
+	const char	*end;
+
+	if (NULL == mac) return (NGVJ_EINVAL);
+
+	if (17 != strlen(mac)) return (NGVJ_EINVAL);
+	end = mac + 17;
+
+	/*
+	 * Seems like sscanf could work with a %x, but '0x' will scan to 0.
+	 */
+#	define HX_CHECK(p) ( \
+		'0' == *p || '1' == *p || '2' == *p || '3' == *p || \
+		'4' == *p || '5' == *p || '6' == *p || '7' == *p || \
+		'8' == *p || '9' == *p || 'a' == *p || 'b' == *p || \
+		'c' == *p || 'd' == *p || 'e' == *p || 'f' == *p || \
+		'A' == *p || 'B' == *p || 'C' == *p || 'D' == *p || \
+		'E' == *p || 'F' == *p \
+	)
+	while (mac < end) {
+		if (!HX_CHECK(mac)) return (NGVJ_EINVAL);
+		mac++;
+		if (!HX_CHECK(mac)) return (NGVJ_EINVAL);
+		mac++;
+		if (mac != end && ':' != *mac) return (NGVJ_EINVAL);
+		mac++;
+	}
+
+	return (NGVJ_OK);
+}
+
+
+/*
+ * "bridge", "eiface", "ether", "tee", "unknown" or "nonexistent", NULL if
+ * netgraph couldn't be asked.
+ */
+const char *
+ngvj_type(struct ngvj_ctx *ctx, const char *node)
+{
+	const char	*type;
+	char		path[NG_PATHSIZ];
+
+	ngvj_begin(ctx, "nodeinfo");
+	if (NGVJ_OK != ngvj_path(path, sizeof(path), node)) {
+		errno = EINVAL;
+		(void) ngvj_error(ctx);
+		return (NULL);
+	}
+	if (NULL == (type = ng_type(ctx->csock, path)))
+		(void) ngvj_error(ctx);
+	return (type);
+}
+
+
+/* is node the expected type, "nonexistent" to check it isn't there */
+int
+ngvj_check(struct ngvj_ctx *ctx, const char *node, const char *expected)
+{
+	const char	*type;
+
+	if (NULL == (type = ngvj_type(ctx, node)))
+		return ((EINVAL == ctx->sys_errno) ? NGVJ_EINVAL : NGVJ_ESYS);
+	if (0 == strcmp(type, expected))
+		return (NGVJ_OK);
+	if (0 == strcmp(type, "nonexistent"))
+		return (NGVJ_ENOENT);
+	if (0 == strcmp(expected, "nonexistent"))
+		return (NGVJ_EEXIST);
+	return (NGVJ_ETYPE);
+}
+
+
+/* shard 0 is the bridge itself, the rest are "<bridge>-s<shard>" */
+int
+ngvj_shard_name(char *dst, size_t len, const char *bridge, int shard)
+{
+	if (NGVJ_OK != ngvj_path(dst, len, bridge) || shard < 0 ||
+	    shard >= NGVJ_SHARD_MAX)
+		return (NGVJ_EINVAL);
+	if (0 == shard)
+		(void) strlcpy(dst, bridge, len);
+	else
+		(void) snprintf(dst, len, "%s-s%d", bridge, shard);
+	return (NGVJ_OK);
+}
@@ -0,0 +1,146 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * libngvjail, everything ng-bridge(8) and ng-eiface(8) do for programs that
+ * would rather not fork and exec them and then pick through what they print.
+ *
+ * Names are plain node (and interface) names, no ':' on the end. Every call
+ * returns NGVJ_OK or one of the NGVJ_E* codes below and never prints or exits.
+ * A context belongs to the caller and is only safe in one thread at a time,
+ * use one per thread if you need more.
+ */
+
+#ifndef _NGVJAIL_H
+#define _NGVJAIL_H
+
+#include <sys/types.h>
+
+#define	NGVJ_VERSION	2
+
+#define	NGVJ_SHARD_MAX	16
+#define	NGVJ_STORM_MAX	976562	/* pps, ng_car scales by 1024 and takes 1e9 */
+#define	NGVJ_ANNOUNCE_MAX 10	/* rounds for ngvj_eiface_announce() */
+#define	NGVJ_NAMESIZ	32	/* room for any node or hook name, NG_NODESIZ */
+
+/* ngvj_open() flags */
+#define	NGVJ_DATA	0x01	/* data socket too, for ngvj_tap_recv() and the proxy */
+#define	NGVJ_ROUTE	0x02	/* routing socket too, needed for ngvj_eiface_wait() */
+
+enum {
+	NGVJ_OK = 0,
+	NGVJ_ESYS,	/* a system or netgraph call failed, see ngvj_strerror() */
+	NGVJ_EINVAL,	/* bad name, mac address or argument */
+	NGVJ_ENOENT,	/* no such node */
+	NGVJ_EEXIST,	/* node already exists, or link already tapped */
+	NGVJ_ETYPE,	/* node isn't the type needed */
+	NGVJ_EBUSY,	/* ether is already connected to a bridge */
+	NGVJ_ETIMEDOUT,	/* eiface wasn't ready in time, or netgraph didn't answer */
+	NGVJ_NERR
+};
+
+/*
+ * Yours to allocate, ngvj_open() fills it in. Don't touch the members, the
+ * one exception is polling csock or dsock for readability.
+ */
+struct ngvj_ctx {
+	int		csock;		/* netgraph control socket */
+	int		dsock;		/* netgraph data socket or -1 */
+	int		rsock;		/* routing socket or -1 */
+	int		sys_errno;	/* errno behind the last error */
+	const char	*step;		/* what was being done when it happened */
+	char		msg[128];	/* ngvj_strerror() */
+	struct ngvj_proxy *proxy;	/* ngvj_proxy_start() */
+};
+
+/* one for each link on the bridge, for ngvj_bridge_list() */
+struct ngvj_link {
+	const char	*shard;		/* the ng_bridge node it is on */
+	const char	*hook;		/* on the bridge */
+	const char	*peer;		/* name, or [id] if it hasn't one */
+	const char	*type;		/* of the peer */
+};
+
+/* ngvj_storm_stats(), counts are broadcast and multicast frames from the wire */
+struct ngvj_storm {
+	u_int64_t	pps;		/* the limit */
+	u_int64_t	passed;
+	u_int64_t	dropped;
+};
+
+/* ngvj_proxy_stats(), since ngvj_proxy_start() */
+struct ngvj_proxy_stats {
+	u_int64_t	answered;	/* requests we replied to for the bridge */
+	u_int64_t	forwarded;	/* requests we couldn't, sent on */
+};
+
+typedef int (*ngvj_link_cb)(const struct ngvj_link *, void *);
+
+struct sockaddr;
+struct bpf_program;
+struct ngvj_proxy;
+
+int		ngvj_open(struct ngvj_ctx *, int);
+void		ngvj_close(struct ngvj_ctx *);
+const char	*ngvj_strerror(struct ngvj_ctx *, int);
+
+int		ngvj_valid_name(const char *);
+int		ngvj_valid_mac(const char *);
+const char	*ngvj_type(struct ngvj_ctx *, const char *);
+int		ngvj_check(struct ngvj_ctx *, const char *, const char *);
+int		ngvj_shard_name(char *, size_t, const char *, int);
+
+int		ngvj_bridge_create(struct ngvj_ctx *, const char *);
+int		ngvj_ether_busy(struct ngvj_ctx *, const char *);
+int		ngvj_bridge_attach(struct ngvj_ctx *, const char *, const char *);
+int		ngvj_bridge_shard(struct ngvj_ctx *, const char *, int);
+int		ngvj_bridge_destroy(struct ngvj_ctx *, const char *);
+int		ngvj_bridge_list(struct ngvj_ctx *, const char *, ngvj_link_cb,
+		    void *);
+int		ngvj_bridge_tunnel(struct ngvj_ctx *, const char *,
+		    const struct sockaddr *, const struct sockaddr *, char *, size_t);
+int		ngvj_storm_set(struct ngvj_ctx *, const char *, u_int);
+int		ngvj_storm_stats(struct ngvj_ctx *, const char *,
+		    struct ngvj_storm *);
+int		ngvj_tap_insert(struct ngvj_ctx *, const char *, const char *,
+		    const struct bpf_program *);
+int		ngvj_tap_remove(struct ngvj_ctx *, const char *, const char *);
+ssize_t		ngvj_tap_recv(struct ngvj_ctx *, void *, size_t);
+
+int		ngvj_proxy_start(struct ngvj_ctx *, const char *);
+int		ngvj_proxy_run(struct ngvj_ctx *, int);
+int		ngvj_proxy_stop(struct ngvj_ctx *);
+int		ngvj_proxy_stats(struct ngvj_ctx *, struct ngvj_proxy_stats *);
+int		ngvj_proxy_bind(struct ngvj_ctx *, const char *, const char *,
+		    const char *, const char *);
+
+int		ngvj_eiface_create(struct ngvj_ctx *, const char *, const char *);
+int		ngvj_eiface_set_mac(struct ngvj_ctx *, const char *, const char *);
+int		ngvj_eiface_wait(struct ngvj_ctx *, const char *, const char *, int);
+int		ngvj_eiface_move(struct ngvj_ctx *, const char *, const char *);
+int		ngvj_eiface_destroy(struct ngvj_ctx *, const char *);
+int		ngvj_eiface_announce(struct ngvj_ctx *, const char *, const char *,
+		    const char * const *, int, int);
+
+#endif /* _NGVJAIL_H */
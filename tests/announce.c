@@ -0,0 +1,135 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Announcing against the fake netgraph. The frames have to go out our
+ * "announce" hook into the eiface's link, through a tee spliced in or the
+ * proxy's bpf, and the link has to be just as it was afterwards with nothing
+ * left on our socket.
+ */
+
+#define	ANNOUNCE_LOCK	"/tmp/ngvjail-test.announce"
+
+#include "fake-netgraph.h"
+#include "../ngvjail.c"
+#include "../ngvjail-bridge.c"
+#include "../ngvjail-eiface.c"
+#include "../ngvjail-proxy.c"
+
+#define	MAC	"02:00:00:00:00:0a"
+
+static const char *const Addrs[] = { "192.0.2.10", "2001:db8::a" };
+
+
+static void
+check_plain(void)
+{
+	int		nodes;
+	struct ngvj_ctx	ctx;
+	struct fake_node *bridge;
+
+	fake_reset();
+	CHECK(NGVJ_OK == ngvj_open(&ctx, NGVJ_DATA));
+	CHECK(NGVJ_OK == ngvj_bridge_create(&ctx, "br"));
+	CHECK(NGVJ_OK == ngvj_eiface_create(&ctx, "br", "jail0"));
+	CHECK(NULL != (bridge = fake_lookup("jail0:ether")));
+	nodes = fake_nodes();
+
+	CHECK(NGVJ_OK == ngvj_eiface_announce(&ctx, "jail0", MAC, Addrs, 2, 1));
+	CHECK(2 == fake_sent);
+	CHECK(0 == strcmp(fake_data_hook, "announce"));
+	CHECK(0 == strcmp(fake_data_peer, "tee"));
+	CHECK(ETHER_ADDR_LEN < fake_data_len);
+	CHECK(0 == bcmp(fake_data + ETHER_ADDR_LEN, ether_aton(MAC),
+	    ETHER_ADDR_LEN));
+
+	/* the tee joined the link up again on its way out */
+	CHECK(bridge == fake_lookup("jail0:ether"));
+	CHECK(0 == strcmp(fake_lookup("br:link0")->type, "eiface"));
+	CHECK(0 == fake_lookup(".:")->nhooks);
+	CHECK(nodes == fake_nodes());
+
+	/* the frames are sent from the data socket */
+	ngvj_close(&ctx);
+	CHECK(NGVJ_OK == ngvj_open(&ctx, 0));
+	CHECK(NGVJ_EINVAL == ngvj_eiface_announce(&ctx, "jail0", MAC, Addrs,
+	    2, 1));
+	ngvj_close(&ctx);
+}
+
+
+static void
+check_proxied(void)
+{
+	int		nodes;
+	struct ngvj_ctx	ctx;
+	struct fake_node *bpf;
+
+	fake_reset();
+	CHECK(NGVJ_OK == ngvj_open(&ctx, NGVJ_DATA));
+	CHECK(NGVJ_OK == ngvj_bridge_create(&ctx, "br"));
+	(void) fake_node("br-proxy", "socket");
+	CHECK(NGVJ_OK == ngvj_eiface_create(&ctx, "br", "jail0"));
+	CHECK(NULL != (bpf = fake_lookup("jail0:ether")));
+	CHECK(0 == strcmp(bpf->type, "bpf") && 2 == bpf->nhooks);
+	nodes = fake_nodes();
+
+	/* its own hook on the bpf, the jail's link is left alone */
+	CHECK(NGVJ_OK == ngvj_eiface_announce(&ctx, "jail0", MAC, Addrs, 1, 1));
+	CHECK(1 == fake_sent);
+	CHECK(0 == strcmp(fake_data_peer, "bpf"));
+	CHECK(bpf == fake_lookup("jail0:ether") && 2 == bpf->nhooks);
+	CHECK(0 == fake_lookup(".:")->nhooks);
+	CHECK(nodes == fake_nodes());
+	ngvj_close(&ctx);
+}
+
+
+static void
+check_unlinked(void)
+{
+	struct ngvj_ctx	ctx;
+
+	fake_reset();
+	CHECK(NGVJ_OK == ngvj_open(&ctx, NGVJ_DATA));
+	(void) fake_node("jail0", "eiface");
+	CHECK(NGVJ_ESYS == ngvj_eiface_announce(&ctx, "jail0", MAC, Addrs,
+	    1, 1));
+	CHECK(0 == fake_sent);
+	CHECK(0 == fake_lookup(".:")->nhooks);
+	ngvj_close(&ctx);
+}
+
+
+int
+main(void)
+{
+	check_plain();
+	check_proxied();
+	check_unlinked();
+	(void) unlink(ANNOUNCE_LOCK);
+
+	(void) printf("announce: ok\n");
+	return (0);
+}
@@ -0,0 +1,608 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define	FAKE_NETGRAPH_IMPL
+#include "fake-netgraph.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	NODES_MAX	8192
+#define	QUEUE_MAX	16
+
+int	fake_rcvbuf;
+int	fake_maxsockbuf;
+int	fake_drop;
+int	fake_late;
+int	fake_sent;
+char	fake_data_hook[NG_HOOKSIZ];
+char	fake_data_peer[NG_TYPESIZ];
+u_char	fake_data[FAKE_FRAME];
+int	fake_data_len;
+
+static struct fake_node	*Node[NODES_MAX];
+static int		Nodes;
+static ng_ID_t		NextID;
+static int		Token;
+static struct fake_node	*Self;		/* our socket node, "." */
+
+/* replies waiting on the control socket, and ones that haven't got there */
+static struct ng_mesg	*Queue[QUEUE_MAX];
+static int		Queued;
+static struct ng_mesg	*Held[QUEUE_MAX];
+static int		Holding;
+
+
+void
+fake_reset(void)
+{
+	int	idx;
+
+	for (idx = 0; idx < Nodes; idx++) {
+		free(Node[idx]->hook);
+		free(Node[idx]);
+	}
+	for (idx = 0; idx < Queued; idx++) free(Queue[idx]);
+	for (idx = 0; idx < Holding; idx++) free(Held[idx]);
+	Nodes = Queued = Holding = 0;
+	NextID = 1;
+	fake_rcvbuf = 20480;		/* what ng_socket starts with */
+	fake_maxsockbuf = 2 * 1024 * 1024;
+	fake_drop = fake_late = 0;
+	fake_sent = fake_data_len = 0;
+	*fake_data_hook = *fake_data_peer = '\0';
+	Self = fake_node("", "socket");
+}
+
+
+struct fake_node *
+fake_node(const char *name, const char *type)
+{
+	struct fake_node	*node;
+
+	if (Nodes == NODES_MAX || NULL == (node = calloc(1, sizeof(*node))))
+		abort();
+	node->id = NextID++;
+	(void) strlcpy(node->name, name, sizeof(node->name));
+	(void) strlcpy(node->type, type, sizeof(node->type));
+	Node[Nodes++] = node;
+	return (node);
+}
+
+
+int
+fake_nodes(void)
+{
+	return (Nodes);
+}
+
+
+static struct fake_hook *
+find_hook(const struct fake_node *node, const char *name)
+{
+	int	idx;
+
+	for (idx = 0; idx < node->nhooks; idx++)
+		if (0 == strcmp(node->hook[idx].name, name))
+			return (&node->hook[idx]);
+	return (NULL);
+}
+
+
+static void
+add_hook(struct fake_node *node, const char *name, struct fake_node *peer,
+    const char *peerhook)
+{
+	struct fake_hook	*hook;
+
+	if (node->nhooks == node->maxhooks) {
+		node->maxhooks = node->maxhooks ? 2 * node->maxhooks : 8;
+		node->hook = realloc(node->hook,
+		    node->maxhooks * sizeof(*node->hook));
+		if (NULL == node->hook) abort();
+	}
+	hook = &node->hook[node->nhooks++];
+	(void) strlcpy(hook->name, name, sizeof(hook->name));
+	(void) strlcpy(hook->peerhook, peerhook, sizeof(hook->peerhook));
+	hook->peer = peer;
+}
+
+
+void
+fake_connect(struct fake_node *a, const char *ahook, struct fake_node *b,
+    const char *bhook)
+{
+	add_hook(a, ahook, b, bhook);
+	add_hook(b, bhook, a, ahook);
+}
+
+
+int
+fake_queued(void)
+{
+	return (Queued);
+}
+
+
+static struct fake_node *
+by_id(ng_ID_t id)
+{
+	int	idx;
+
+	for (idx = 0; idx < Nodes; idx++)
+		if (Node[idx]->id == id) return (Node[idx]);
+	return (NULL);
+}
+
+
+/*
+ * "name:", "[id]:" or ".:" and any of them followed by hooks separated by
+ * '.', each meaning its peer. Without the ':' the hooks are from node, the
+ * way NGM_CONNECT and NGM_MKPEER take their paths.
+ */
+static struct fake_node *
+resolve(const char *path, struct fake_node *node)
+{
+	int			idx;
+	size_t			len;
+	const char		*colon, *hook;
+	char			name[NG_HOOKSIZ];
+	struct fake_hook	*hk;
+
+	if (NULL != (colon = strchr(path, ':'))) {
+		len = colon - path;
+		node = NULL;
+		if ('[' == *path) {
+			node = by_id((ng_ID_t) strtoul(path + 1, NULL, 16));
+		} else if (0 == len || (1 == len && '.' == *path)) {
+			node = Self;
+		} else {
+			for (idx = 0; idx < Nodes && NULL == node; idx++)
+				if (len == strlen(Node[idx]->name) &&
+				    0 == strncmp(Node[idx]->name, path, len))
+					node = Node[idx];
+		}
+		path = colon + 1;
+	}
+	for (hook = path; NULL != node && '\0' != *hook; hook += len) {
+		if ('.' == *hook) hook++;
+		len = strcspn(hook, ".");
+		if (0 == len) break;
+		(void) snprintf(name, sizeof(name), "%.*s", (int) len, hook);
+		hk = find_hook(node, name);
+		node = (NULL == hk) ? NULL : hk->peer;
+	}
+	return (node);
+}
+
+
+/* a path the way NgSendMsg() takes it, from our socket */
+struct fake_node *
+fake_lookup(const char *path)
+{
+	return (resolve(path, Self));
+}
+
+
+/* ng_bridge numbers a bare "link" or "uplink" itself, the lowest free one */
+static int
+hook_name(const struct fake_node *node, const char *want, char *name)
+{
+	int	num;
+
+	(void) strlcpy(name, want, NG_HOOKSIZ);
+	if (0 == strcmp(node->type, "bridge") &&
+	    (0 == strcmp(want, "link") || 0 == strcmp(want, "uplink"))) {
+		for (num = ('u' == *want) ? 1 : 0; ; num++) {
+			(void) snprintf(name, NG_HOOKSIZ, "%s%d", want, num);
+			if (NULL == find_hook(node, name)) break;
+		}
+	}
+	if (NULL != find_hook(node, name)) {
+		errno = EEXIST;
+		return (-1);
+	}
+	return (0);
+}
+
+
+static int
+join(struct fake_node *a, const char *ahook, struct fake_node *b,
+    const char *bhook)
+{
+	char	aname[NG_HOOKSIZ], bname[NG_HOOKSIZ];
+
+	if (a == b) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (-1 == hook_name(a, ahook, aname) || -1 == hook_name(b, bhook, bname))
+		return (-1);
+	fake_connect(a, aname, b, bname);
+	return (0);
+}
+
+
+static void shutdown_node(struct fake_node *);
+
+/* the node types that don't outlive their last hook */
+static int
+transient(const struct fake_node *node)
+{
+	static const char *const Type[] = {
+		"bpf", "car", "ksocket", "one2many", "tee", NULL
+	};
+	int	idx;
+
+	for (idx = 0; NULL != Type[idx]; idx++)
+		if (0 == strcmp(node->type, Type[idx])) return (1);
+	return (0);
+}
+
+
+static void
+drop_hook(struct fake_node *node, struct fake_hook *hook)
+{
+	int	idx = hook - node->hook;
+
+	bcopy(node->hook + idx + 1, node->hook + idx,
+	    (--node->nhooks - idx) * sizeof(*node->hook));
+}
+
+
+/* both ends go, and either node may go with them */
+static void
+unjoin(struct fake_node *node, struct fake_hook *hook)
+{
+	struct fake_node	*peer = hook->peer;
+	char			peerhook[NG_HOOKSIZ];
+
+	(void) strlcpy(peerhook, hook->peerhook, sizeof(peerhook));
+	drop_hook(node, hook);
+	drop_hook(peer, find_hook(peer, peerhook));
+	if (0 == node->nhooks && transient(node)) shutdown_node(node);
+	if (0 == peer->nhooks && transient(peer)) shutdown_node(peer);
+}
+
+
+/* ng_tee joins left and right back together on its way out */
+static void
+shutdown_node(struct fake_node *node)
+{
+	int			idx;
+	struct fake_hook	*left, *right;
+	struct fake_node	*lpeer = NULL, *rpeer = NULL;
+	char			lhook[NG_HOOKSIZ], rhook[NG_HOOKSIZ];
+
+	if (0 == strcmp(node->type, "tee") &&
+	    NULL != (left = find_hook(node, "left")) &&
+	    NULL != (right = find_hook(node, "right"))) {
+		lpeer = left->peer;
+		rpeer = right->peer;
+		(void) strlcpy(lhook, left->peerhook, sizeof(lhook));
+		(void) strlcpy(rhook, right->peerhook, sizeof(rhook));
+		drop_hook(lpeer, find_hook(lpeer, lhook));
+		drop_hook(rpeer, find_hook(rpeer, rhook));
+		drop_hook(node, find_hook(node, "left"));
+		drop_hook(node, find_hook(node, "right"));
+		fake_connect(lpeer, lhook, rpeer, rhook);
+	}
+
+	/* out of the list first, so nothing comes back here while it goes */
+	for (idx = 0; idx < Nodes && Node[idx] != node; idx++)
+		;
+	if (idx == Nodes) return;
+	bcopy(Node + idx + 1, Node + idx, (--Nodes - idx) * sizeof(*Node));
+	while (node->nhooks > 0)
+		unjoin(node, &node->hook[node->nhooks - 1]);
+	free(node->hook);
+	free(node);
+}
+
+
+static void
+node_info(struct nodeinfo *ni, const struct fake_node *node)
+{
+	bzero(ni, sizeof(*ni));
+	(void) strlcpy(ni->name, node->name, sizeof(ni->name));
+	(void) strlcpy(ni->type, node->type, sizeof(ni->type));
+	ni->id = node->id;
+	ni->hooks = node->nhooks;
+}
+
+
+static struct ng_mesg *
+reply(int token, int cmd, const struct fake_node *node)
+{
+	int		idx;
+	size_t		len;
+	struct ng_mesg	*msg;
+	struct hooklist	*hl;
+
+	len = (NGM_LISTHOOKS == cmd) ? sizeof(struct hooklist) +
+	    node->nhooks * sizeof(struct linkinfo) : sizeof(struct nodeinfo);
+	if (NULL == (msg = calloc(1, sizeof(*msg) + len))) abort();
+	msg->header.token = token;
+	msg->header.cmd = cmd;
+	msg->header.flags = NGF_RESP;
+	msg->header.typecookie = NGM_GENERIC_COOKIE;
+	msg->header.arglen = len;
+	if (NGM_NODEINFO == cmd) {
+		node_info((struct nodeinfo *) msg->data, node);
+		return (msg);
+	}
+	hl = (struct hooklist *) msg->data;
+	node_info(&hl->nodeinfo, node);
+	for (idx = 0; idx < node->nhooks; idx++) {
+		(void) strlcpy(hl->link[idx].ourhook, node->hook[idx].name,
+		    sizeof(hl->link[idx].ourhook));
+		(void) strlcpy(hl->link[idx].peerhook, node->hook[idx].peerhook,
+		    sizeof(hl->link[idx].peerhook));
+		node_info(&hl->link[idx].nodeinfo, node->hook[idx].peer);
+	}
+	return (msg);
+}
+
+
+/* what the kernel does with a reply: queue it unless it can't fit */
+static void
+deliver(struct ng_mesg *msg)
+{
+	if (Queued == QUEUE_MAX ||
+	    (int) (sizeof(*msg) + msg->header.arglen) > fake_rcvbuf) {
+		free(msg);
+		return;
+	}
+	Queue[Queued++] = msg;
+}
+
+
+/* a reply to a question nobody is asking any more */
+void
+fake_stale(struct fake_node *node)
+{
+	deliver(reply(++Token, NGM_LISTHOOKS, node));
+}
+
+
+/* ng_eiface names its node after the interface it makes */
+static void
+eiface_name(struct fake_node *node)
+{
+	int	num;
+	char	name[NG_NODESIZ];
+
+	for (num = 0; ; num++) {
+		(void) snprintf(name, sizeof(name), "ngeth%d:", num);
+		if (NULL == fake_lookup(name)) break;
+	}
+	name[strlen(name) - 1] = '\0';
+	(void) strlcpy(node->name, name, sizeof(node->name));
+}
+
+
+/* the generic messages that change the graph, as ng_base does them */
+static int
+generic(struct fake_node *node, int cmd, const void *arg)
+{
+	const struct ngm_mkpeer		*mp = arg;
+	const struct ngm_connect	*cn = arg;
+	const struct ngm_rmhook		*rm = arg;
+	const struct ngm_name		*nm = arg;
+	struct fake_node		*peer;
+	struct fake_hook		*hook;
+	char				path[NG_PATHSIZ];
+
+	switch (cmd) {
+	case NGM_MKPEER:
+		peer = fake_node("", mp->type);
+		if (-1 == join(node, mp->ourhook, peer, mp->peerhook)) {
+			shutdown_node(peer);
+			return (-1);
+		}
+		if (0 == strcmp(mp->type, "eiface")) eiface_name(peer);
+		return (0);
+	case NGM_CONNECT:
+		if (NULL == (peer = resolve(cn->path, node))) {
+			errno = ENOENT;
+			return (-1);
+		}
+		return (join(node, cn->ourhook, peer, cn->peerhook));
+	case NGM_RMHOOK:
+		if (NULL == (hook = find_hook(node, rm->ourhook))) {
+			errno = ENOENT;
+			return (-1);
+		}
+		unjoin(node, hook);
+		return (0);
+	case NGM_SHUTDOWN:
+		if (node != Self) shutdown_node(node);
+		return (0);
+	case NGM_NAME:
+		(void) snprintf(path, sizeof(path), "%s:", nm->name);
+		if (NULL != fake_lookup(path)) {
+			errno = EADDRINUSE;
+			return (-1);
+		}
+		(void) strlcpy(node->name, nm->name, sizeof(node->name));
+		return (0);
+	default:
+		return (0);
+	}
+}
+
+
+int
+NgSendMsg(int cs, const char *path, int cookie, int cmd, const void *arg,
+    size_t arglen)
+{
+	int			idx;
+	struct fake_node	*node;
+	struct ng_mesg		*msg;
+
+	/* the late ones finally get there */
+	for (idx = 0; idx < Holding; idx++) deliver(Held[idx]);
+	Holding = 0;
+
+	if (NULL == (node = fake_lookup(path))) {
+		errno = ENOENT;
+		return (-1);
+	}
+	++Token;
+	if (NGM_GENERIC_COOKIE != cookie) return (Token);
+	if (NGM_NODEINFO != cmd && NGM_LISTHOOKS != cmd)
+		return ((-1 == generic(node, cmd, arg)) ? -1 : Token);
+
+	msg = reply(Token, cmd, node);
+	if (NGM_LISTHOOKS != cmd) {
+		deliver(msg);
+	} else if (fake_drop > 0) {
+		fake_drop--;
+		free(msg);
+	} else if (fake_late > 0 && Holding < QUEUE_MAX) {
+		fake_late--;
+		Held[Holding++] = msg;
+	} else {
+		deliver(msg);
+	}
+	return (Token);
+}
+
+
+int
+NgAllocRecvMsg(int cs, struct ng_mesg **rep, char *path)
+{
+	int	len;
+
+	if (0 == Queued) {
+		errno = EAGAIN;
+		return (-1);
+	}
+	*rep = Queue[0];
+	len = sizeof(**rep) + (*rep)->header.arglen;
+	bcopy(Queue + 1, Queue, --Queued * sizeof(*Queue));
+	return (len);
+}
+
+
+int
+NgRecvMsg(int cs, struct ng_mesg *rep, size_t len, char *path)
+{
+	errno = EAGAIN;
+	return (-1);
+}
+
+
+/* ours is made by fake_reset(), a named one is somebody else's to find */
+int
+NgMkSockNode(const char *name, int *csp, int *dsp)
+{
+	if (NULL != name) (void) fake_node(name, "socket");
+	*csp = FAKE_CSOCK;
+	if (NULL != dsp) *dsp = FAKE_DSOCK;
+	return (0);
+}
+
+
+int
+NgSendData(int ds, const char *hook, const u_char *buf, size_t len)
+{
+	struct fake_hook	*h;
+
+	if (len > sizeof(fake_data)) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	fake_sent++;
+	(void) strlcpy(fake_data_hook, hook, sizeof(fake_data_hook));
+	(void) strlcpy(fake_data_peer, NULL != (h = find_hook(Self, hook)) ?
+	    h->peer->type : "", sizeof(fake_data_peer));
+	bcopy(buf, fake_data, len);
+	fake_data_len = len;
+	return (0);
+}
+
+
+int
+NgRecvData(int ds, u_char *buf, size_t len, char *hook)
+{
+	errno = EAGAIN;
+	return (-1);
+}
+
+
+/* replies are either there already or never coming, nothing waits */
+int
+fake_poll(struct pollfd *pfd, nfds_t nfds, int timeout)
+{
+	nfds_t	idx;
+	int	ready = 0;
+
+	for (idx = 0; idx < nfds; idx++) {
+		pfd[idx].revents = 0;
+		if (FAKE_CSOCK == pfd[idx].fd && Queued > 0) {
+			pfd[idx].revents = POLLIN;
+			ready++;
+		}
+	}
+	return (ready);
+}
+
+
+int
+fake_getsockopt(int s, int level, int name, void *val, socklen_t *len)
+{
+	if (SOL_SOCKET != level || SO_RCVBUF != name || *len < sizeof(int)) {
+		errno = ENOPROTOOPT;
+		return (-1);
+	}
+	*(int *) val = fake_rcvbuf;
+	*len = sizeof(int);
+	return (0);
+}
+
+
+int
+fake_setsockopt(int s, int level, int name, const void *val, socklen_t len)
+{
+	if (SOL_SOCKET != level || SO_RCVBUF != name || len < sizeof(int)) {
+		errno = ENOPROTOOPT;
+		return (-1);
+	}
+	if (*(const int *) val > fake_maxsockbuf) {
+		errno = ENOBUFS;
+		return (-1);
+	}
+	fake_rcvbuf = *(const int *) val;
+	return (0);
+}
+
+
+/* interfaces aren't faked, only their netgraph side */
+int
+fake_ioctl(int s, unsigned long req, ...)
+{
+	return (0);
+}
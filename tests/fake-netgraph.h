@@ -0,0 +1,110 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _DMARKER_FAKE_NETGRAPH_H
+#define _DMARKER_FAKE_NETGRAPH_H
+
+/*
+ * Just enough of libnetgraph(3) and the kernel behind it to run the library
+ * code without netgraph. There is a graph of nodes and hooks that the tests
+ * build, NGM_NODEINFO and NGM_LISTHOOKS are answered from it, and the generic
+ * messages that change it (mkpeer, connect, rmhook, shutdown and name) do so
+ * the way ng_base would. Nodes that go away with their last hook do, ng_tee
+ * joins its neighbours on shutdown and ng_bridge numbers bare "link" and
+ * "uplink" hooks. Every other message is taken without doing anything. Data
+ * sent is recorded, with what our hook was connected to.
+ *
+ * Include this before common.h: the socket calls the library makes on the
+ * control socket are pointed at the fakes too, so the receive buffer can be
+ * checked and replies bigger than it are lost the way the kernel loses them.
+ * Interface ioctls just succeed, there are no interfaces.
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netgraph.h>
+
+#define	FAKE_CSOCK	100
+#define	FAKE_DSOCK	101
+#define	FAKE_FRAME	9018
+
+struct fake_hook {
+	char		name[NG_HOOKSIZ];
+	char		peerhook[NG_HOOKSIZ];
+	struct fake_node *peer;
+};
+
+struct fake_node {
+	ng_ID_t		id;
+	char		name[NG_NODESIZ];
+	char		type[NG_TYPESIZ];
+	int		nhooks;
+	int		maxhooks;
+	struct fake_hook *hook;
+};
+
+extern int	fake_rcvbuf;		/* the control socket's SO_RCVBUF */
+extern int	fake_maxsockbuf;	/* kern.ipc.maxsockbuf */
+extern int	fake_drop;		/* lose this many hook lists */
+extern int	fake_late;		/* hold this many until the next message */
+extern int	fake_sent;		/* frames sent with NgSendData() */
+extern char	fake_data_hook[NG_HOOKSIZ];
+extern char	fake_data_peer[NG_TYPESIZ];	/* on our end of it, or "" */
+extern u_char	fake_data[FAKE_FRAME];	/* the last one */
+extern int	fake_data_len;
+
+struct fake_node *fake_node(const char *, const char *);
+void		fake_connect(struct fake_node *, const char *, struct fake_node *,
+		    const char *);
+void		fake_reset(void);
+int		fake_nodes(void);	/* our socket's is one */
+struct fake_node *fake_lookup(const char *);
+int		fake_queued(void);
+void		fake_stale(struct fake_node *);
+
+int		fake_poll(struct pollfd *, nfds_t, int);
+int		fake_getsockopt(int, int, int, void *, socklen_t *);
+int		fake_setsockopt(int, int, int, const void *, socklen_t);
+int		fake_ioctl(int, unsigned long, ...);
+
+#ifndef FAKE_NETGRAPH_IMPL
+#define	poll		fake_poll
+#define	getsockopt	fake_getsockopt
+#define	setsockopt	fake_setsockopt
+#define	ioctl		fake_ioctl
+#endif
+
+/* tests stop at the first failure, saying where */
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		(void) fprintf(stderr, "%s:%d: failed: %s\n",		\
+		    __FILE__, __LINE__, #cond);				\
+		exit(1);						\
+	}								\
+} while (0)
+
+#endif /* _DMARKER_FAKE_NETGRAPH_H */
@@ -0,0 +1,184 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A bridge with 4096 links, more than the control socket can take a list
+ * of as it comes, against the fake netgraph. ng_list_hooks() has to size
+ * the receive buffer for it, ask again when a reply is lost, and never mix
+ * up a late reply with the answer to a later question.
+ *
+ * Then the same number of links made and taken apart through the library the
+ * way ng-eiface and ng-bridge do it, with nothing left over afterwards.
+ */
+
+#include "fake-netgraph.h"
+#include "../ngvjail.c"
+#include "../ngvjail-bridge.c"
+#include "../ngvjail-eiface.c"
+#include "../ngvjail-proxy.c"
+
+#define	LINKS	4096
+#define	SHARDS	4
+
+static struct fake_node *
+big_bridge(void)
+{
+	int			idx;
+	char			name[NG_NODESIZ], hook[NG_HOOKSIZ];
+	struct fake_node	*bridge, *eiface;
+
+	fake_reset();
+	bridge = fake_node("big", "bridge");
+	for (idx = 0; idx < LINKS; idx++) {
+		(void) snprintf(name, sizeof(name), "jail%d", idx);
+		(void) snprintf(hook, sizeof(hook), "link%d", idx);
+		eiface = fake_node(name, "eiface");
+		fake_connect(bridge, hook, eiface, "ether");
+	}
+	return (bridge);
+}
+
+static void
+check_list(struct ng_mesg *resp)
+{
+	int		idx;
+	char		name[NG_NODESIZ], hook[NG_HOOKSIZ];
+	struct hooklist *hlist = (struct hooklist *) resp->data;
+
+	CHECK(NGM_LISTHOOKS == resp->header.cmd);
+	CHECK(LINKS == hlist->nodeinfo.hooks);
+	CHECK(0 == strcmp(hlist->nodeinfo.type, "bridge"));
+	for (idx = 0; idx < LINKS; idx++) {
+		(void) snprintf(name, sizeof(name), "jail%d", idx);
+		(void) snprintf(hook, sizeof(hook), "link%d", idx);
+		CHECK(0 == strcmp(hlist->link[idx].ourhook, hook));
+		CHECK(0 == strcmp(hlist->link[idx].peerhook, "ether"));
+		CHECK(0 == strcmp(hlist->link[idx].nodeinfo.name, name));
+		CHECK(0 == strcmp(hlist->link[idx].nodeinfo.type, "eiface"));
+	}
+}
+
+/*
+ * A sharded bridge with an ether, filled through ngvj_eiface_create(), which
+ * picks the least loaded shard each time, and emptied by
+ * ngvj_bridge_destroy(). That leaves the ether free again and the eifaces
+ * unconnected, and once they are destroyed there is only our socket.
+ */
+static void
+check_scale(void)
+{
+	int		idx, shard, count;
+	char		name[NG_NODESIZ], path[NG_PATHSIZ];
+	struct ngvj_ctx	ctx;
+
+	fake_reset();
+	(void) fake_node("em0", "ether");
+	CHECK(NGVJ_OK == ngvj_open(&ctx, 0));
+	CHECK(NGVJ_OK == ngvj_bridge_create(&ctx, "big"));
+	CHECK(NGVJ_OK == ngvj_ether_busy(&ctx, "em0"));
+	CHECK(NGVJ_OK == ngvj_bridge_attach(&ctx, "big", "em0"));
+	CHECK(NGVJ_EBUSY == ngvj_ether_busy(&ctx, "em0"));
+	CHECK(NGVJ_OK == ngvj_bridge_shard(&ctx, "big", SHARDS));
+
+	for (idx = 0; idx < LINKS; idx++) {
+		(void) snprintf(name, sizeof(name), "jail%d", idx);
+		CHECK(NGVJ_OK == ngvj_eiface_create(&ctx, "big", name));
+	}
+	CHECK(2 + SHARDS + LINKS == fake_nodes());
+	for (shard = 0; shard < SHARDS; shard++) {
+		shard_path(path, sizeof(path), "big:", shard);
+		count = shard_eifaces(FAKE_CSOCK, path);
+		CHECK(LINKS / SHARDS == count);
+	}
+	CHECK(NGVJ_EEXIST == ngvj_eiface_create(&ctx, "big", "jail0"));
+
+	CHECK(NGVJ_OK == ngvj_bridge_destroy(&ctx, "big"));
+	CHECK(NGVJ_OK == ngvj_ether_busy(&ctx, "em0"));
+	CHECK(2 + LINKS == fake_nodes());
+	for (idx = 0; idx < LINKS; idx++) {
+		(void) snprintf(name, sizeof(name), "jail%d", idx);
+		CHECK(NGVJ_OK == ngvj_eiface_destroy(&ctx, name));
+	}
+	CHECK(NULL != fake_lookup("em0:"));
+	CHECK(2 == fake_nodes());
+	ngvj_close(&ctx);
+}
+
+int
+main(void)
+{
+	size_t		need;
+	const char	*type;
+	struct fake_node *bridge;
+	struct ng_mesg	*resp;
+
+	need = sizeof(struct ng_mesg) + sizeof(struct hooklist) +
+	    LINKS * sizeof(struct linkinfo);
+
+	/* the default buffer is far too small, it has to be grown */
+	(void) big_bridge();
+	CHECK((size_t) fake_rcvbuf < need);
+	CHECK(-1 != ng_list_hooks(FAKE_CSOCK, "big:", &resp));
+	CHECK((size_t) fake_rcvbuf >= need);
+	check_list(resp);
+	free(resp);
+	CHECK(0 == fake_queued());
+	CHECK(LINKS == ng_hooks(FAKE_CSOCK, "big:"));
+	CHECK(LINKS == shard_eifaces(FAKE_CSOCK, "big:"));
+
+	/* a reply that never comes means asking again with more room */
+	(void) big_bridge();
+	fake_drop = 1;
+	CHECK(-1 != ng_list_hooks(FAKE_CSOCK, "big:", &resp));
+	CHECK((size_t) fake_rcvbuf >= 2 * need);
+	check_list(resp);
+	free(resp);
+
+	/* a late first reply is dropped, not left for the next reader */
+	bridge = big_bridge();
+	fake_late = 1;
+	CHECK(-1 != ng_list_hooks(FAKE_CSOCK, "big:", &resp));
+	check_list(resp);
+	free(resp);
+	CHECK(0 == fake_queued());
+	type = ng_type(FAKE_CSOCK, "big:");
+	CHECK(NULL != type && 0 == strcmp(type, "bridge"));
+
+	/* even one already queued before the question is asked */
+	fake_stale(bridge);
+	type = ng_type(FAKE_CSOCK, "big:");
+	CHECK(NULL != type && 0 == strcmp(type, "bridge"));
+	CHECK(0 == fake_queued());
+
+	/* kern.ipc.maxsockbuf too small for it is an error, not a hang */
+	(void) big_bridge();
+	fake_maxsockbuf = need / 2;
+	CHECK(-1 == ng_list_hooks(FAKE_CSOCK, "big:", &resp));
+	CHECK(ENOBUFS == errno);
+
+	check_scale();
+
+	(void) printf("list-hooks: ok\n");
+	return (0);
+}
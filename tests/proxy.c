@@ -0,0 +1,365 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The proxy's bpf programs and what it does with the frames they send it,
+ * against the fake netgraph. The programs are run by libpcap's interpreter on
+ * sample ARP and neighbor discovery frames: jail_prog() has to pick out the
+ * requests the proxy may answer and leave everything else to the bridge, and
+ * eiface_prog() has to drop only requests for addresses that aren't the
+ * jail's. frame() has to answer only for bound addresses and send the rest
+ * on unchanged. Last, the links the proxy takes over and lets go of as
+ * eifaces come and go, through the library the way ng-eiface does it.
+ */
+
+#include "fake-netgraph.h"
+#include "../ngvjail.c"
+#include "../ngvjail-bridge.c"
+#include "../ngvjail-eiface.c"
+#include "../ngvjail-proxy.c"
+
+#include <pcap.h>
+
+static const u_char	Jail1[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 0, 1 };
+static const u_char	Jail2[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 0, 2 };
+static const u_char	Bcast[ETHER_ADDR_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const u_char	Zero[16];
+
+static int
+matches(struct bpf_insn *prog, int len, const u_char *f, int flen)
+{
+	struct bpf_program	bp = {
+		.bf_len = len,
+		.bf_insns = prog
+	};
+	struct pcap_pkthdr	h = {
+		.caplen = flen,
+		.len = flen
+	};
+
+	return (0 != pcap_offline_filter(&bp, &h, f));
+}
+
+
+static const u_char *
+ip(int family, const char *addr)
+{
+	static u_char	buf[4][16];
+	static int	next;
+	u_char		*a = buf[next++ % 4];
+
+	CHECK(1 == inet_pton(family, addr, a));
+	return (a);
+}
+
+
+static int
+arp(u_char *f, int op, const u_char *sha, const char *spa, const char *tpa)
+{
+	return (arp_frame(f, op, Bcast, sha, ip(AF_INET, spa), Zero,
+	    ip(AF_INET, tpa)));
+}
+
+
+/* a solicitation is an advertisement with a different type and option */
+static int
+ns(u_char *f, const u_char *mac, const char *src, const char *target)
+{
+	int	len;
+
+	len = na_frame(f, Bcast, mac, ip(AF_INET6, target), Zero, 0);
+	f[OFF_ICMP6] = ND_NEIGHBOR_SOLICIT;
+	f[OFF_ND_OPT] = ND_OPT_SOURCE_LINKADDR;
+	bcopy(ip(AF_INET6, src), f + OFF_IP6_SRC, 16);
+	return (len);
+}
+
+
+static void
+bind_addr(struct ngvj_proxy *px, const char *eiface, const u_char *mac,
+    const char *addr)
+{
+	struct proxy_bind	pb;
+
+	bzero(&pb, sizeof(pb));
+	(void) strlcpy(pb.eiface, eiface, sizeof(pb.eiface));
+	bcopy(mac, pb.mac, sizeof(pb.mac));
+	pb.family = (NULL == strchr(addr, ':')) ? AF_INET : AF_INET6;
+	bcopy(ip(pb.family, addr), pb.addr, addr_len(pb.family));
+	binding(FAKE_CSOCK, px, &pb);
+}
+
+
+static void
+check_jail_prog(void)
+{
+	int		len, flen;
+	u_char		f[FAKE_FRAME];
+	struct bpf_insn	prog[PROXY_INSNS];
+
+	len = jail_prog(prog);
+
+	/* requests for somebody else go to the proxy */
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.1");
+	CHECK(matches(prog, len, f, flen));
+	flen = ns(f, Jail2, "2001:db8::2", "2001:db8::1");
+	CHECK(matches(prog, len, f, flen));
+
+	/* probes, gratuitous ARP and DAD are for everybody to see */
+	flen = arp(f, 1, Jail2, "0.0.0.0", "10.0.0.2");
+	CHECK(!matches(prog, len, f, flen));
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.2");
+	CHECK(!matches(prog, len, f, flen));
+	flen = ns(f, Jail2, "::", "2001:db8::2");
+	CHECK(!matches(prog, len, f, flen));
+
+	/* and anything that isn't a request */
+	flen = arp(f, 2, Jail2, "10.0.0.2", "10.0.0.1");
+	CHECK(!matches(prog, len, f, flen));
+	flen = na_frame(f, Bcast, Jail2, ip(AF_INET6, "2001:db8::2"), Zero, 0);
+	CHECK(!matches(prog, len, f, flen));
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.1");
+	f[OFF_TYPE + 1] = 0x00;			/* IPv4 */
+	CHECK(!matches(prog, len, f, flen));
+
+	/* a request cut short can't be read, the bridge gets it */
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.1");
+	CHECK(!matches(prog, len, f, OFF_ARP_SPA));
+}
+
+
+static void
+check_eiface_prog(void)
+{
+	int		len, flen, idx;
+	char		addr[INET6_ADDRSTRLEN];
+	u_char		f[FAKE_FRAME];
+	struct bpf_insn	prog[PROXY_INSNS];
+	struct ngvj_proxy *px;
+	struct plink	jail1 = {
+		.eiface = "jail1"
+	};
+	struct plink	jail2 = {
+		.eiface = "jail2"
+	};
+
+	CHECK(NULL != (px = calloc(1, sizeof(*px))));
+
+	/* nothing bound, nothing is known not to be the jail's */
+	len = eiface_prog(px, &jail1, prog);
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.9");
+	CHECK(matches(prog, len, f, flen));
+	flen = ns(f, Jail2, "2001:db8::2", "2001:db8::9");
+	CHECK(matches(prog, len, f, flen));
+
+	bind_addr(px, "jail1", Jail1, "10.0.0.1");
+	bind_addr(px, "jail1", Jail1, "2001:db8::1");
+	len = eiface_prog(px, &jail1, prog);
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.1");
+	CHECK(matches(prog, len, f, flen));
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.9");
+	CHECK(!matches(prog, len, f, flen));
+	flen = ns(f, Jail2, "2001:db8::2", "2001:db8::1");
+	CHECK(matches(prog, len, f, flen));
+	flen = ns(f, Jail2, "2001:db8::2", "2001:db8::9");
+	CHECK(!matches(prog, len, f, flen));
+
+	/* a neighbour's gratuitous ARP isn't a request for anybody's address */
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.2");
+	CHECK(matches(prog, len, f, flen));
+	flen = arp(f, 1, Jail2, "10.0.0.9", "10.0.0.9");
+	CHECK(matches(prog, len, f, flen));
+
+	/* only requests are dropped, and only to the jail they were bound to */
+	flen = arp(f, 2, Jail2, "10.0.0.2", "10.0.0.9");
+	CHECK(matches(prog, len, f, flen));
+	flen = na_frame(f, Bcast, Jail2, ip(AF_INET6, "2001:db8::9"), Zero, 0);
+	CHECK(matches(prog, len, f, flen));
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.9");
+	f[OFF_TYPE + 1] = 0x00;
+	CHECK(matches(prog, len, f, flen));
+	len = eiface_prog(px, &jail2, prog);
+	flen = arp(f, 1, Jail1, "10.0.0.1", "10.0.0.9");
+	CHECK(matches(prog, len, f, flen));
+
+	/* as many addresses as can be bound, and one too many */
+	for (idx = 2; idx <= PROXY_ADDRS + 1; idx++) {
+		(void) snprintf(addr, sizeof(addr), "10.0.1.%d", idx);
+		bind_addr(px, "jail1", Jail1, addr);
+		(void) snprintf(addr, sizeof(addr), "2001:db8::1:%d", idx);
+		bind_addr(px, "jail1", Jail1, addr);
+	}
+	CHECK(2 * PROXY_ADDRS == px->nbind);
+	len = eiface_prog(px, &jail1, prog);
+	CHECK(len <= PROXY_INSNS);
+	(void) snprintf(addr, sizeof(addr), "10.0.1.%d", PROXY_ADDRS);
+	flen = arp(f, 1, Jail2, "10.0.0.2", addr);
+	CHECK(matches(prog, len, f, flen));
+	(void) snprintf(addr, sizeof(addr), "2001:db8::1:%d", PROXY_ADDRS);
+	flen = ns(f, Jail2, "2001:db8::2", addr);
+	CHECK(matches(prog, len, f, flen));
+	(void) snprintf(addr, sizeof(addr), "2001:db8::1:%d", PROXY_ADDRS + 1);
+	flen = ns(f, Jail2, "2001:db8::2", addr);
+	CHECK(!matches(prog, len, f, flen));
+
+	free(px->bind);
+	free(px);
+}
+
+
+static void
+check_frame(void)
+{
+	int		flen;
+	u_char		f[FAKE_FRAME];
+	struct ngvj_proxy *px;
+
+	fake_reset();
+	CHECK(NULL != (px = calloc(1, sizeof(*px))));
+	bind_addr(px, "jail1", Jail1, "10.0.0.1");
+	bind_addr(px, "jail1", Jail1, "2001:db8::1");
+
+	/* a bound address is answered straight back down r */
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.1");
+	frame(FAKE_DSOCK, px, f, flen, "q1a");
+	CHECK(1 == fake_sent);
+	CHECK(0 == strcmp(fake_data_hook, "r1a"));
+	CHECK(ARP_LEN <= fake_data_len);
+	CHECK(2 == fake_data[OFF_ARP_OP + 1]);
+	CHECK(0 == bcmp(fake_data, Jail2, ETHER_ADDR_LEN));
+	CHECK(0 == bcmp(fake_data + OFF_ARP_SHA, Jail1, ETHER_ADDR_LEN));
+	CHECK(0 == bcmp(fake_data + OFF_ARP_SPA, ip(AF_INET, "10.0.0.1"), 4));
+	CHECK(0 == bcmp(fake_data + OFF_ARP_THA, Jail2, ETHER_ADDR_LEN));
+	CHECK(0 == bcmp(fake_data + OFF_ARP_TPA, ip(AF_INET, "10.0.0.2"), 4));
+
+	flen = ns(f, Jail2, "2001:db8::2", "2001:db8::1");
+	frame(FAKE_DSOCK, px, f, flen, "q1a");
+	CHECK(2 == fake_sent);
+	CHECK(0 == strcmp(fake_data_hook, "r1a"));
+	CHECK(NA_LEN == fake_data_len);
+	CHECK(ND_NEIGHBOR_ADVERT == fake_data[OFF_ICMP6]);
+	CHECK(0 == bcmp(fake_data, Jail2, ETHER_ADDR_LEN));
+	CHECK(0 == bcmp(fake_data + OFF_ND_TARGET, ip(AF_INET6, "2001:db8::1"), 16));
+	CHECK(0 == bcmp(fake_data + OFF_IP6_DST, ip(AF_INET6, "2001:db8::2"), 16));
+	CHECK(0 == icmp6_cksum(fake_data, NA_LEN - OFF_ICMP6));
+	CHECK(2 == px->stats.answered);
+
+	/* anything else goes on to the bridge untouched */
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.9");
+	frame(FAKE_DSOCK, px, f, flen, "q1a");
+	CHECK(0 == strcmp(fake_data_hook, "q1a"));
+	CHECK(flen == fake_data_len && 0 == bcmp(fake_data, f, flen));
+	flen = ns(f, Jail2, "2001:db8::2", "2001:db8::9");
+	frame(FAKE_DSOCK, px, f, flen, "q1a");
+	CHECK(0 == strcmp(fake_data_hook, "q1a"));
+	CHECK(flen == fake_data_len && 0 == bcmp(fake_data, f, flen));
+
+	/* nobody is told their own address */
+	flen = arp(f, 1, Jail1, "10.0.0.1", "10.0.0.1");
+	f[OFF_ARP_SPA + 3] = 5;
+	frame(FAKE_DSOCK, px, f, flen, "q1b");
+	CHECK(0 == strcmp(fake_data_hook, "q1b"));
+
+	/* and what a jail says about itself is never taken as the truth */
+	flen = arp(f, 1, Jail2, "10.0.0.2", "10.0.0.1");
+	frame(FAKE_DSOCK, px, f, flen, "q1a");
+	flen = arp(f, 1, Jail1, "10.0.0.1", "10.0.0.2");
+	frame(FAKE_DSOCK, px, f, flen, "q1b");
+	CHECK(0 == strcmp(fake_data_hook, "q1b"));
+	CHECK(2 == px->nbind);
+	CHECK(3 == px->stats.answered && 4 == px->stats.forwarded);
+
+	free(px->bind);
+	free(px);
+}
+
+
+/*
+ * An eiface made while the proxy runs comes with its bpf and is adopted
+ * without its link being touched again. One that was there before the proxy
+ * is spliced. Rescans after that only need the bridge's hook list, and a
+ * destroyed eiface takes its bpf with it.
+ */
+static void
+check_links(void)
+{
+	int			nodes;
+	struct ngvj_ctx		ctx, jail;
+	struct ngvj_proxy	*px;
+	struct fake_node	*bpf;
+
+	fake_reset();
+	CHECK(NGVJ_OK == ngvj_open(&jail, 0));
+	CHECK(NGVJ_OK == ngvj_bridge_create(&jail, "br"));
+	CHECK(NGVJ_OK == ngvj_eiface_create(&jail, "br", "jail0"));
+	CHECK(0 == strcmp(fake_lookup("jail0:ether")->type, "bridge"));
+
+	CHECK(NGVJ_OK == ngvj_open(&ctx, NGVJ_DATA));
+	CHECK(NGVJ_OK == ngvj_proxy_start(&ctx, "br"));
+	px = ctx.proxy;
+	CHECK(1 == px->nlink);
+	CHECK(0 == strcmp(fake_lookup("jail0:ether")->type, "bpf"));
+	CHECK(5 == fake_lookup("jail0:ether")->nhooks);
+
+	CHECK(NGVJ_OK == ngvj_eiface_create(&jail, "br", "jail1"));
+	CHECK(NULL != (bpf = fake_lookup("jail1:ether")));
+	CHECK(0 == strcmp(bpf->type, "bpf"));
+	CHECK(2 == bpf->nhooks);
+	CHECK(bpf == fake_lookup("br:link1"));
+	CHECK(0 == rescan(FAKE_CSOCK, px));
+	CHECK(2 == px->nlink);
+	CHECK(bpf == fake_lookup("jail1:ether") && 5 == bpf->nhooks);
+	CHECK(bpf->id == px->link[1].bpf);
+	CHECK(0 == strcmp(px->link[1].eiface, "jail1"));
+
+	nodes = fake_nodes();
+	CHECK(0 == rescan(FAKE_CSOCK, px));
+	CHECK(2 == px->nlink && nodes == fake_nodes());
+	CHECK(5 == px->link[0].hooks && 5 == px->link[1].hooks);
+
+	/* the eiface, its bpf and the one2many */
+	CHECK(NGVJ_OK == ngvj_eiface_destroy(&jail, "jail1"));
+	CHECK(nodes - 3 == fake_nodes());
+	CHECK(0 == rescan(FAKE_CSOCK, px));
+	CHECK(1 == px->nlink);
+
+	/* stopping puts the rest back the way they were */
+	CHECK(NGVJ_OK == ngvj_proxy_stop(&ctx));
+	CHECK(0 == strcmp(fake_lookup("jail0:ether")->type, "bridge"));
+	ngvj_close(&ctx);
+	ngvj_close(&jail);
+}
+
+
+int
+main(void)
+{
+	check_jail_prog();
+	check_eiface_prog();
+	check_frame();
+	check_links();
+
+	(void) printf("proxy: ok\n");
+	return (0);
+}
@@ -0,0 +1,140 @@
+/*-
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2017 David Marker
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Tunnels against the fake netgraph. Each ng_ksocket has to end up straight
+ * on an uplink ng_bridge numbered for it, with nothing of the way it was put
+ * there left on our socket. destroy_bridge() has to take the sockets with
+ * it, there is nobody else to do it.
+ */
+
+#include "fake-netgraph.h"
+#include "../ngvjail.c"
+#include "../ngvjail-bridge.c"
+#include "../ngvjail-eiface.c"
+#include "../ngvjail-proxy.c"
+
+#include <arpa/inet.h>
+
+static void
+sin4(struct sockaddr_in *sin, const char *addr, int port)
+{
+	bzero(sin, sizeof(*sin));
+	sin->sin_len = sizeof(*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	CHECK(1 == inet_pton(AF_INET, addr, &sin->sin_addr));
+}
+
+
+static void
+sin6(struct sockaddr_in6 *sin, const char *addr, int port)
+{
+	bzero(sin, sizeof(*sin));
+	sin->sin6_len = sizeof(*sin);
+	sin->sin6_family = AF_INET6;
+	sin->sin6_port = htons(port);
+	CHECK(1 == inet_pton(AF_INET6, addr, &sin->sin6_addr));
+}
+
+
+/* what is on bridge:hook, and the hook it is on there */
+static void
+check_socket(const char *hook, const char *proto)
+{
+	char			path[NG_PATHSIZ];
+	struct fake_node	*ks;
+
+	(void) snprintf(path, sizeof(path), "tun:%s", hook);
+	CHECK(NULL != (ks = fake_lookup(path)));
+	CHECK(0 == strcmp(ks->type, "ksocket"));
+	CHECK(1 == ks->nhooks);
+	CHECK(0 == strcmp(ks->hook[0].name, proto));
+	CHECK(0 == strcmp(ks->hook[0].peerhook, hook));
+}
+
+
+int
+main(void)
+{
+	char			hook[NG_HOOKSIZ];
+	struct sockaddr_in	local, peer;
+	struct sockaddr_in6	local6, peer6;
+	struct ngm_rmhook	rm;
+	struct ngvj_ctx		ctx;
+
+	fake_reset();
+	CHECK(NGVJ_OK == ngvj_open(&ctx, 0));
+	CHECK(NGVJ_OK == ngvj_bridge_create(&ctx, "tun"));
+	CHECK(NGVJ_OK == ngvj_eiface_create(&ctx, "tun", "jail0"));
+
+	/* uplinks are numbered from 1, links have their own numbers */
+	sin4(&local, "192.0.2.1", 4789);
+	sin4(&peer, "192.0.2.2", 4789);
+	CHECK(NGVJ_OK == ngvj_bridge_tunnel(&ctx, "tun",
+	    (struct sockaddr *) &local, (struct sockaddr *) &peer,
+	    hook, sizeof(hook)));
+	CHECK(0 == strcmp(hook, "uplink1"));
+	check_socket(hook, "inet/dgram/udp");
+
+	sin6(&local6, "2001:db8::1", 4789);
+	sin6(&peer6, "2001:db8::2", 4789);
+	CHECK(NGVJ_OK == ngvj_bridge_tunnel(&ctx, "tun",
+	    (struct sockaddr *) &local6, (struct sockaddr *) &peer6,
+	    hook, sizeof(hook)));
+	CHECK(0 == strcmp(hook, "uplink2"));
+	check_socket(hook, "inet6/dgram/udp");
+
+	/* no tee left over, and nothing on our socket */
+	CHECK(0 == fake_lookup(".:")->nhooks);
+	CHECK(5 == fake_nodes());
+
+	/* a socket goes with its hook, and the number is free again */
+	(void) strlcpy(rm.ourhook, "uplink1", sizeof(rm.ourhook));
+	CHECK(-1 != NgSendMsg(FAKE_CSOCK, "tun:", NGM_GENERIC_COOKIE,
+	    NGM_RMHOOK, &rm, sizeof(rm)));
+	CHECK(4 == fake_nodes());
+	CHECK(NGVJ_OK == ngvj_bridge_tunnel(&ctx, "tun",
+	    (struct sockaddr *) &local, (struct sockaddr *) &peer,
+	    hook, sizeof(hook)));
+	CHECK(0 == strcmp(hook, "uplink1"));
+	check_socket(hook, "inet/dgram/udp");
+
+	/* mixed families are refused before anything is made */
+	CHECK(NGVJ_EINVAL == ngvj_bridge_tunnel(&ctx, "tun",
+	    (struct sockaddr *) &local, (struct sockaddr *) &peer6,
+	    hook, sizeof(hook)));
+	CHECK(5 == fake_nodes());
+
+	/* the bridge takes its sockets with it, the eiface is left */
+	CHECK(NGVJ_OK == ngvj_bridge_destroy(&ctx, "tun"));
+	CHECK(2 == fake_nodes());
+	CHECK(NULL != fake_lookup("jail0:"));
+	CHECK(NGVJ_OK == ngvj_eiface_destroy(&ctx, "jail0"));
+	CHECK(1 == fake_nodes());
+	ngvj_close(&ctx);
+
+	(void) printf("tunnel: ok\n");
+	return (0);
+}